@@ -0,0 +1,126 @@
+/**
+ * @file    AsyncWriter.cc
+ * @brief   Stream buffer written to a file descriptor by a background thread
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+
+#include "Utility.h"
+#include "AsyncWriter.h"
+
+#ifdef BITVECTOR_LIB_BEGIN
+using namespace BitVectorLib;
+#endif
+
+CAsyncWriter::CAsyncWriter(int fd, size_t buffer_size){
+  if(buffer_size<1) Quit("Invalid buffer size: "<<buffer_size);
+  m_fd=fd;
+  m_buffers.resize(N_BUFFERS,std::vector<char>(buffer_size));
+  m_length.resize(N_BUFFERS,0);
+  for(int32_t i=1;i<N_BUFFERS;++i) m_free.push_back(i);
+  m_filling=0;
+  m_writing=-1;
+  m_closing=false;
+  setp(&m_buffers[0][0],&m_buffers[0][0]+buffer_size);
+  m_running = pthread_create(&m_thread,0,Start,this)==0;
+}
+
+CAsyncWriter::~CAsyncWriter(){
+  Stop();
+}
+
+void* CAsyncWriter::Start(void* p){
+  CAsyncWriter* w = static_cast<CAsyncWriter*>(p);
+  for(;;){
+    int32_t buffer;
+    {
+      CLock lock(w->m_mutex);
+      while(w->m_full.empty() && !w->m_closing) w->m_has_full.Wait(w->m_mutex);
+      if(w->m_full.empty()) break;
+      buffer=w->m_writing=w->m_full.front();
+      w->m_full.pop_front();
+    }
+    w->WriteOut(buffer);
+    CLock lock(w->m_mutex);
+    w->m_writing=-1;
+    w->m_free.push_back(buffer);
+    w->m_has_free.Broadcast();
+  }
+  return 0;
+}
+
+// Runs without the lock; only m_error is shared, and it is read after Wait()
+void CAsyncWriter::WriteOut(int32_t buffer){
+  const char* p = &m_buffers[buffer][0];
+  size_t n = m_length[buffer];
+  while(n>0 && m_error.empty()){
+    ssize_t written = write(m_fd,p,n);
+    if(written<0){
+      if(errno==EINTR) continue;
+      m_error=std::strerror(errno);
+      break;
+    }
+    p+=written;
+    n-=written;
+  }
+}
+
+// Queue the buffer being filled and continue in a free one
+void CAsyncWriter::Submit(){
+  if(!m_running){
+    // No writer thread; write in the calling thread
+    m_length[m_filling]=pptr()-pbase();
+    WriteOut(m_filling);
+    setp(pbase(),epptr());
+    return;
+  }
+  CLock lock(m_mutex);
+  m_length[m_filling]=pptr()-pbase();
+  m_full.push_back(m_filling);
+  m_has_full.Signal();
+  while(m_free.empty()) m_has_free.Wait(m_mutex);
+  m_filling=m_free.back();
+  m_free.pop_back();
+  std::vector<char>& b = m_buffers[m_filling];
+  setp(&b[0],&b[0]+b.size());
+}
+
+// Until every queued buffer is written
+void CAsyncWriter::Wait(){
+  if(!m_running) return;
+  CLock lock(m_mutex);
+  while(!m_full.empty() || m_writing>=0) m_has_free.Wait(m_mutex);
+}
+
+CAsyncWriter::int_type CAsyncWriter::overflow(int_type c){
+  Submit();
+  if(traits_type::eq_int_type(c,traits_type::eof())) return traits_type::not_eof(c);
+  *pptr()=traits_type::to_char_type(c);
+  pbump(1);
+  return c;
+}
+
+int CAsyncWriter::sync(){
+  if(pptr()>pbase()) Submit();
+  Wait();
+  return m_error.empty()? 0: -1;
+}
+
+void CAsyncWriter::Stop(){
+  sync();
+  if(!m_running) return;
+  {
+    CLock lock(m_mutex);
+    m_closing=true;
+    m_has_full.Signal();
+  }
+  pthread_join(m_thread,0);
+  m_running=false;
+}
+
+void CAsyncWriter::Close(){
+  Stop();
+  if(!m_error.empty()) Quit("Cannot write to file descriptor "<<m_fd<<": "<<m_error);
+}
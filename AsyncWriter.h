@@ -0,0 +1,64 @@
+/**
+ * @file    AsyncWriter.h
+ * @brief   Stream buffer written to a file descriptor by a background thread
+ */
+
+#ifndef _ASYNC_WRITER_H_
+#define _ASYNC_WRITER_H_
+
+#include <stdint.h>
+#include <cstddef>
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <deque>
+#include <pthread.h>
+#include "Thread.h"
+
+/**
+ * @brief std::streambuf that hands full buffers to a writer thread
+ *
+ * Output is collected in one of N_BUFFERS buffers of buffer_size bytes. A
+ * full buffer is queued for the writer thread, which write(2)s it while the
+ * caller fills the next one; the caller waits only when every buffer is
+ * queued. Lines are not flushed one by one, so write '\n' rather than
+ * std::endl: an explicit flush (std::endl, std::flush) waits until everything
+ * before it is written. Close() flushes, stops the thread and throws by Quit()
+ * if a write has failed; the destructor closes silently.
+ */
+class CAsyncWriter : public std::streambuf {
+ public:
+  static const size_t DEFAULT_BUFFER_SIZE=1024*1024;
+  static const int32_t N_BUFFERS=4;
+ private:
+  int m_fd;
+  std::vector<std::vector<char> > m_buffers;
+  std::vector<size_t> m_length;
+  std::vector<int32_t> m_free;
+  std::deque<int32_t> m_full;
+  int32_t m_filling;
+  int32_t m_writing;
+  bool m_closing;
+  bool m_running;
+  std::string m_error;
+  CMutex m_mutex;
+  CCondition m_has_full;   // signaled to the writer thread
+  CCondition m_has_free;   // signaled to the caller
+  pthread_t m_thread;
+  CAsyncWriter(const CAsyncWriter&);
+  CAsyncWriter& operator=(const CAsyncWriter&);
+  void Submit();
+  void Wait();
+  void WriteOut(int32_t buffer);
+  void Stop();
+  static void* Start(void* p);
+ protected:
+  int_type overflow(int_type c);
+  int sync();
+ public:
+  explicit CAsyncWriter(int fd, size_t buffer_size=DEFAULT_BUFFER_SIZE);
+  ~CAsyncWriter();
+  void Close();
+};
+
+#endif // _ASYNC_WRITER_H_
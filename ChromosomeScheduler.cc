@@ -0,0 +1,181 @@
+/**
+ * @file    ChromosomeScheduler.cc
+ * @brief   Process chromosomes of an indexed BAM file on several threads
+ */
+
+#include <iostream>
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <unistd.h>
+
+#include "Option.h"
+#include "Utility.h"
+#include "FileReader.h"
+#include "SAMAlignment.h"
+#include "SAMReader.h"
+#include "CoverageDistribution.h"
+#include "Thread.h"
+#include "ChromosomeScheduler.h"
+
+#ifdef BITVECTOR_LIB_BEGIN
+using namespace BitVectorLib;
+#endif
+
+static bool readable(const std::string& path){return access(path.c_str(),R_OK)==0;}
+
+// samtools accepts x.bam.bai, x.bai and x.bam.csi
+bool CChromosomeScheduler::HasIndex(const char *bam_file){
+  std::string bam(bam_file);
+  if(bam.size()<=4 || bam.compare(bam.size()-4,4,".bam")!=0) return false;
+  return readable(bam+".bai") || readable(bam.substr(0,bam.size()-4)+".bai") || readable(bam+".csi");
+}
+
+typedef std::map<int32_t,std::pair<std::string,int64_t> > references_t;
+
+// Reference names and lengths in the header, by chromosome
+static void read_references(const std::string& bam, CChromosomeNormalizer& cn, references_t* references){
+  CFileReader fr(("samtools view -H '"+bam+"'|").c_str());
+  while(fr.GetContentLine("")){
+    std::string name;
+    int64_t length;
+    if(!check_prefix("@SQ\t",fr.CurrentLine()) || !CSAMReader::ParseReference(fr.CurrentLine(),&name,&length)) continue;
+    int32_t chr = cn.Chr(name.c_str());
+    if(chr>0 && references->find(chr)==references->end()) (*references)[chr]=std::make_pair(name,length);
+  }
+}
+
+// Lazily read configuration is read here, before threads share it
+static void read_shared_configuration(){
+  CCigarString cigar;
+  CCoverageDistribution covdist;
+}
+
+void CChromosomeScheduler::SetUp(const char *bam_file, const CGeneralFeatureVector& variants, CChromosomeNormalizer& cn){
+  if(!HasIndex(bam_file)) Quit("No index (.bai or .csi) of "<<bam_file);
+  std::string bam(bam_file);
+  references_t references;
+  read_references(bam,cn,&references);
+
+  std::map<int32_t,CGeneralFeatureVector> by_chr;
+  foreach_const(CGeneralFeatureVector, var, variants) by_chr[cn.Chr(var->Name())].push_back(*var);
+
+  m_jobs.clear();
+  for(std::map<int32_t,CGeneralFeatureVector>::const_iterator it=by_chr.begin();it!=by_chr.end();++it){
+    if(it->first<=0) continue;
+    job_t job;
+    job.Chr=it->first;
+    job.Length=0;
+    job.First=m_jobs.empty();
+    job.Variants=it->second;
+    job.Normalizer=cn;
+    job.Normalizer.ClearUnknown();
+    references_t::const_iterator ref=references.find(job.Chr);
+    if(ref!=references.end()){
+      job.Reference=ref->second.first;
+      job.Length=ref->second.second;
+      job.Input="samtools view -h '"+bam+"' '"+job.Reference+"'|";
+    }else{
+      // No alignment can be on the chromosome; read the header only
+      job.Input="samtools view -H '"+bam+"'|";
+    }
+    m_jobs.push_back(job);
+  }
+
+  // Largest first, so that a long chromosome does not start last
+  std::vector<std::pair<int64_t,uint32_t> > size_order;
+  for(uint32_t i=0;i<m_jobs.size();++i) size_order.push_back(std::make_pair(-m_jobs[i].Length,i));
+  std::sort(size_order.begin(),size_order.end());
+  m_schedule.clear();
+  for(uint32_t i=0;i<size_order.size();++i) m_schedule.push_back(size_order[i].second);
+}
+
+void CChromosomeScheduler::Worker(void* arg, int32_t thread_id){
+  CChromosomeScheduler* s = static_cast<CChromosomeScheduler*>(arg);
+  for(;;){
+    uint32_t i = __sync_fetch_and_add(&s->m_next,1);
+    if(i>=s->m_schedule.size()) break;
+    job_t& job = s->m_jobs[s->m_schedule[i]];
+    if(Option().Find("verbose")){
+      CLock lock(s->m_log_mutex);
+      std::cerr<<"# thread "<<thread_id<<": chromosome "<<job.Chr<<" ("<<(job.Reference.empty()? "not in header": job.Reference)<<")"<<std::endl;
+    }
+    s->m_process(job);
+  }
+}
+
+void CChromosomeScheduler::Run(int32_t n_threads, process_t process, CChromosomeNormalizer& cn){
+  read_shared_configuration();
+  m_process=process;
+  m_next=0;
+  n_threads = std::min<int32_t>(n_threads,m_jobs.size());
+  CThreadGroup threads;
+  threads.Run(n_threads,Worker,this);
+  for(uint32_t i=0;i<m_jobs.size();++i) cn.MergeUnknown(m_jobs[i].Normalizer);
+}
+
+void CChromosomeScheduler::Write(std::ostream& out, std::ostream& log, std::ostream* window) const {
+  for(uint32_t i=0;i<m_jobs.size();++i){
+    log<<m_jobs[i].Log;
+    if(window) (*window)<<m_jobs[i].Window;
+    out<<m_jobs[i].Out;
+  }
+  out.flush();
+  log.flush();
+  if(window) window->flush();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool CRegionScheduler::SetUp(const char *bam_file, int32_t chr, int32_t n_threads, CChromosomeNormalizer& cn){
+  if(!CChromosomeScheduler::HasIndex(bam_file)) Quit("No index (.bai or .csi) of "<<bam_file);
+  std::string bam(bam_file);
+  references_t references;
+  read_references(bam,cn,&references);
+  m_jobs.clear();
+  references_t::const_iterator ref=references.find(chr);
+  if(ref==references.end() || ref->second.second<1) return false;
+  const std::string& reference = ref->second.first;
+  int64_t length = ref->second.second;
+
+  int64_t n_regions = std::min<int64_t>(static_cast<int64_t>(REGIONS_PER_THREAD)*n_threads,length/MIN_REGION_SIZE);
+  if(n_regions<1) n_regions=1;
+  for(int64_t i=0;i<n_regions;++i){
+    job_t job;
+    job.Index=i;
+    job.Begin=1+length*i/n_regions;
+    job.End=1+length*(i+1)/n_regions;
+    job.First= i==0;
+    job.Normalizer=cn;
+    job.Normalizer.ClearUnknown();
+    std::ostringstream input;
+    input<<"samtools view -h '"<<bam<<"' '"<<reference<<':'<<job.Begin<<'-'<<job.End-1<<"'|";
+    job.Input=input.str();
+    m_jobs.push_back(job);
+  }
+  return true;
+}
+
+void CRegionScheduler::Worker(void* arg, int32_t thread_id){
+  CRegionScheduler* s = static_cast<CRegionScheduler*>(arg);
+  for(;;){
+    uint32_t i = __sync_fetch_and_add(&s->m_next,1);
+    if(i>=s->m_jobs.size()) break;
+    job_t& job = s->m_jobs[i];
+    if(Option().Find("verbose")){
+      CLock lock(s->m_log_mutex);
+      std::cerr<<"# thread "<<thread_id<<": region "<<job.Index<<" ["<<job.Begin<<","<<job.End<<")"<<std::endl;
+    }
+    s->m_process(job,s->m_arg);
+  }
+}
+
+void CRegionScheduler::Run(int32_t n_threads, process_t process, void* arg, CChromosomeNormalizer& cn){
+  read_shared_configuration();
+  m_process=process;
+  m_arg=arg;
+  m_next=0;
+  n_threads = std::min<int32_t>(n_threads,m_jobs.size());
+  CThreadGroup threads;
+  threads.Run(n_threads,Worker,this);
+  for(uint32_t i=0;i<m_jobs.size();++i) cn.MergeUnknown(m_jobs[i].Normalizer);
+}
@@ -0,0 +1,95 @@
+/**
+ * @file    ChromosomeScheduler.h
+ * @brief   Process chromosomes of an indexed BAM file on several threads
+ */
+
+#ifndef _CHROMOSOME_SCHEDULER_H_
+#define _CHROMOSOME_SCHEDULER_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "GeneralFeature.h"
+#include "Thread.h"
+
+/**
+ * @brief Run a job for each chromosome that has calls, largest chromosome first
+ *
+ * Chromosomes are taken from the @SQ lines of the BAM header. Each job reads
+ * only its own chromosome through "samtools view -h <bam> <reference>", which
+ * needs a .bai or .csi index. A job owns its reader, its copy of the
+ * chromosome normalizer and its output buffers, so jobs share nothing but
+ * read-only configuration. Write() concatenates the buffers in chromosome
+ * order, which makes the output independent of the number of threads.
+ */
+class CChromosomeScheduler {
+ public:
+  struct job_t {
+    int32_t Chr;
+    std::string Reference;           ///< Name in the BAM header; empty if absent
+    int64_t Length;                  ///< LN of the reference; 0 if unknown
+    std::string Input;               ///< Command line reading the alignments, ending with '|'
+    bool First;                      ///< First job in the output order
+    CGeneralFeatureVector Variants;
+    CChromosomeNormalizer Normalizer;
+    std::string Out;
+    std::string Window;              ///< Written apart from Out if any
+    std::string Log;
+  };
+  typedef void (*process_t)(job_t& job);
+ private:
+  std::vector<job_t> m_jobs;         // in chromosome order
+  std::vector<uint32_t> m_schedule;  // largest first
+  process_t m_process;
+  volatile uint32_t m_next;
+  CMutex m_log_mutex;
+  static void Worker(void* arg, int32_t thread_id);
+ public:
+  static bool HasIndex(const char *bam_file);
+  void SetUp(const char *bam_file, const CGeneralFeatureVector& variants, CChromosomeNormalizer& cn);
+  void Run(int32_t n_threads, process_t process, CChromosomeNormalizer& cn);
+  void Write(std::ostream& out, std::ostream& log, std::ostream* window=0) const;
+  inline uint32_t NJobs() const {return m_jobs.size();}
+};
+
+/**
+ * @brief Run a job for each region of a chromosome, in parallel
+ *
+ * The chromosome is split into about REGIONS_PER_THREAD regions per thread,
+ * none shorter than MIN_REGION_SIZE. A job reads its region through
+ * "samtools view -h <bam> <reference>:<begin>-<end>", which also gives the
+ * alignments overlapping the region from its left; jobs treat only the
+ * alignments starting in [Begin,End). Jobs are kept in position order for
+ * the caller to combine.
+ */
+class CRegionScheduler {
+ public:
+  static const int32_t REGIONS_PER_THREAD=4;
+  static const int64_t MIN_REGION_SIZE=1000000;
+  struct job_t {
+    int32_t Index;
+    int64_t Begin;                   ///< First position of the region
+    int64_t End;                     ///< Next to the last position
+    std::string Input;               ///< Command line reading the alignments, ending with '|'
+    bool First;
+    CChromosomeNormalizer Normalizer;
+    std::string Out;
+    std::string Log;
+  };
+  typedef void (*process_t)(job_t& job, void* arg);
+ private:
+  std::vector<job_t> m_jobs;         // in position order
+  process_t m_process;
+  void* m_arg;
+  volatile uint32_t m_next;
+  CMutex m_log_mutex;
+  static void Worker(void* arg, int32_t thread_id);
+ public:
+  /// False if the chromosome is not in the BAM header
+  bool SetUp(const char *bam_file, int32_t chr, int32_t n_threads, CChromosomeNormalizer& cn);
+  void Run(int32_t n_threads, process_t process, void* arg, CChromosomeNormalizer& cn);
+  inline uint32_t NJobs() const {return m_jobs.size();}
+  inline const job_t& Job(uint32_t i) const {return m_jobs[i];}
+};
+
+#endif // _CHROMOSOME_SCHEDULER_H_
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <fstream>
 #include <cassert>
 #include <cstdio>
 #include <cstdlib>
@@ -7,10 +8,12 @@
 #include "Utility.h"
 #include "CoverageArray.h"
 #include "SAMAlignment.h"
+#include "Thread.h"
 #include <algorithm>
 #include <limits>
 #include <cmath>
 #include <cstring>
+#include <sstream>
 
 #ifdef BITVECTOR_LIB_BEGIN
 using namespace BitVectorLib;
@@ -22,39 +25,73 @@ int32_t CCoverageArray::s_window_size =-1;
 
 ////////////////////////////////////////////////////////////////////////////////
 CReadPositions::CReadPositions(){
+  m_last=0;
   m_bin_size = Option().RequireInteger("bin-size");
 }
 
-int64_t CReadPositions::NAlignmentsIn(int64_t begin_pos, int64_t end_pos, int64_t *index) const {
-  //int64_t r_limit=m_read_positions.size();
-  int64_t r_limit=NReads();
-  int64_t r1=*index;
-  for(; 0<=r1 && r1<r_limit && m_read_positions[r1].Begin()>=begin_pos; --r1);
-  for(;          r1<r_limit && m_read_positions[r1].Begin()< begin_pos; ++r1);
-  int64_t r2=r1;
-  for(;          r2<r_limit && m_read_positions[r2].Begin()<=end_pos;   ++r2);
-  *index=r2;
-  return r2-r1;
+// Number of reads starting before p
+int64_t CReadPositions::Rank(int64_t p) const {
+  if(p<=0) return 0;
+  int64_t k=p>>LOW_BITS;
+  if(k>=NBuckets()) return NReads();
+  std::vector<uint8_t>::const_iterator lo=m_low.begin()+m_first[k];
+  std::vector<uint8_t>::const_iterator hi=k+1<NBuckets()? m_low.begin()+m_first[k+1]: m_low.end();
+  return m_first[k]+(std::lower_bound(lo,hi,static_cast<uint8_t>(p&(BUCKET_SIZE-1)))-lo);
+}
+
+void CReadPositions::Save(std::ostream &stream) const {
+  if(!m_first.empty()) stream.write(reinterpret_cast<const char*>(&m_first[0]),m_first.size()*sizeof(uint32_t));
+  if(!m_low.empty())   stream.write(reinterpret_cast<const char*>(&m_low[0]),m_low.size()*sizeof(uint8_t));
+}
+
+// Merge reads of another input, keeping them sorted by their beginnings.
+// Buckets are merged one by one; the low bits in each bucket are sorted.
+void CReadPositions::Merge(const CReadPositions& another){
+  int64_t n_buckets=std::max(NBuckets(),another.NBuckets());
+  std::vector<uint8_t> low(NReads()+another.NReads());
+  std::vector<uint32_t> first(n_buckets);
+  std::vector<uint8_t>::iterator out=low.begin();
+  for(int64_t k=0;k<n_buckets;++k){
+    first[k]=out-low.begin();
+    const CReadPositions* rp[2]={this,&another};
+    std::vector<uint8_t>::const_iterator b[2], e[2];
+    for(int32_t x=0;x<2;++x){
+      if(k<rp[x]->NBuckets()){
+        b[x]=rp[x]->m_low.begin()+rp[x]->m_first[k];
+        e[x]=k+1<rp[x]->NBuckets()? rp[x]->m_low.begin()+rp[x]->m_first[k+1]: rp[x]->m_low.end();
+      }else{
+        b[x]=e[x]=rp[x]->m_low.end();
+      }
+    }
+    out=std::merge(b[0],e[0],b[1],e[1],out);
+  }
+  m_low.swap(low);
+  m_first.swap(first);
+  m_last=std::max(m_last,another.m_last);
+}
+
+const char *CReadPositions::Load(const char *p, int64_t n_reads, int64_t n_buckets){
+  const uint32_t *first = reinterpret_cast<const uint32_t*>(p);
+  m_first.assign(first,first+n_buckets);
+  p += n_buckets*sizeof(uint32_t);
+  const uint8_t *low = reinterpret_cast<const uint8_t*>(p);
+  m_low.assign(low,low+n_reads);
+  p += n_reads*sizeof(uint8_t);
+  // The last read is in the last bucket
+  m_last = n_reads>0? (((n_buckets-1)<<LOW_BITS)|m_low.back()): 0;
+  return p;
 }
 
 bool CReadPositions::TTest(int64_t begin_pos, int64_t end_pos, double mu, int32_t binsize) const{
   std::cerr<<"CCoverageArray::TTest("<<begin_pos<<"-"<<end_pos<<":"<<end_pos-begin_pos+1<<", "<<mu<<", "<<binsize<<")"<<std::endl;
   mu *= binsize;
-  int64_t r1 = 0;
-  int64_t r2 = NReads()-1;
-  int32_t n=1;
-  for(;r2-r1>1;++n){
-    int64_t m=(r1+r2)/2;
-    if(begin_pos<=m_read_positions[m].Begin()){ r2=m; }else{ r1=m; }
-  }
-  int64_t r0=r1;
-  int64_t n_aln = NAlignmentsIn(begin_pos,end_pos,&r1);
+  int64_t n_aln = NAlignmentsIn(begin_pos,end_pos);
   std::cerr<<"Total "<<n_aln<<" reads."<<std::endl;
 
   for(int64_t pos=begin_pos; pos<end_pos; pos+=binsize){
     int64_t pos2 = pos+binsize-1;
     if(pos2>=end_pos) pos2=end_pos-1;
-    int64_t n = NAlignmentsIn(pos,pos2,&r0);
+    int64_t n = NAlignmentsIn(pos,pos2);
     std::cerr<<((pos-begin_pos)/binsize+1)<<": pos="<<pos<<": n="<<n<<std::endl;
   }
   return true;
@@ -63,32 +100,106 @@ bool CReadPositions::TTest(int64_t begin_pos, int64_t end_pos, double mu, int32_
 
 ////////////////////////////////////////////////////////////////////////////////
 CCoverageArray::CCoverageArray(){
-  m_coverage=0;
+  m_is_streaming=false;
+  m_ring_base=0;
+  m_stream_padding=0;
+  m_next_variant=0;
+  m_stream_variants=0;
+  m_stream=0;
+  m_stream_refine_type=REFINE_FRAGMENTED_EDGE;
+  m_use_run_index=false;
+  m_genome_stream=0;
+  m_genome_refine_type=REFINE_FRAGMENTED_EDGE;
+  m_window_stream=&std::cout;
+  m_log_stream=&std::cerr;
+  m_n_threads=CThreadGroup::NThreads();
+  m_max_read_length=Option().RequireInteger("max-read-length");
   m_max_coverage=0;
   m_average_density=0;
   m_refinement_coverage_threshold = Option().RequireInteger("refinement-threshold");
-  m_margin_parameter = Option().RequireInteger("margin-parameter");
-  m_fragment_threshold_rate = Option().RequireDouble("fragment-threshold");
   if(s_window_size<0) s_window_size=Option().RequireInteger("coverage-window");
+  std::string window_output(Option().Find("window-output",""));
+  m_window_binary = window_output.size()>4 && window_output.compare(window_output.size()-4,4,".bin")==0;
   m_output_format=Option().Require("output-format");
   std::cerr<<"# output format="<<m_output_format<<std::endl;
-  m_max_chop_length=Option().RequireInteger("max-chop-length");
-  std::cerr<<"# max chop length="<<m_max_chop_length<<std::endl;
+  SetUpParameterSets();
+  std::cerr<<"# max chop length="<<m_parameter_sets.front().MaxChopLength<<std::endl;
 }
 
-void CCoverageArray::ShowCoverageDistribution(std::ostream &stream){
-  std::vector<int64_t> coverage_distribution(m_max_coverage+1,0);
-  for(int64_t position=MinPosition();position<=MaxPosition();++position){
-    ++coverage_distribution[ m_coverage[position] ];
+// Build the grid given by --parameter-sweep, such as "k=2,3,4:f=0.5,0.8".
+// Parameters not listed in the grid take the values of their own options.
+void CCoverageArray::SetUpParameterSets(){
+  refine_parameter_t base;
+  base.CoverageThreshold = Option().RequireInteger("coverage-threshold");
+  base.FragmentThresholdRate = Option().RequireDouble("fragment-threshold");
+  base.MaxChopLength = Option().RequireInteger("max-chop-length");
+  base.MarginParameter = Option().RequireDouble("margin-parameter");
+  m_parameter_sets.assign(1,base);
+
+  const char *spec = Option().Find("parameter-sweep");
+  if(!spec || !*spec) return;
+  static const char *keys="kfxa";
+  std::vector<double> values[4];
+  CTokenizer td(spec,":");
+  while(td.hasNext()){
+    std::string item = td.NextString();
+    const char *k = item.empty()? 0: std::strchr(keys,item[0]);
+    if(!k || item.length()<3 || item[1]!='=') Quit("Specify <k|f|x|a>=<value>[,<value>...] separated by ':' by --parameter-sweep: "<<item);
+    CTokenizer vd(item.c_str()+2,",");
+    while(vd.hasNext()){
+      std::string v = vd.NextString();
+      // k and x take integers, f and a real numbers
+      bool is_integer = *k=='k' || *k=='x';
+      char *end = 0;
+      double value = is_integer? std::strtol(v.c_str(),&end,10): std::strtod(v.c_str(),&end);
+      if(v.empty() || *end) Quit("Invalid value of "<<*k<<" given by --parameter-sweep: "<<v);
+      values[k-keys].push_back(value);
+    }
   }
+
+  m_parameter_sets.clear();
+  std::vector<uint32_t> index(4,0);
+  for(int32_t i=0;i<4;++i) if(values[i].empty()) index[i]=~0U;
+  for(;;){
+    refine_parameter_t param = base;
+    for(int32_t i=0;i<4;++i){
+      if(index[i]==~0U) continue;
+      double v = values[i][index[i]];
+      switch(keys[i]){
+      case 'k': param.CoverageThreshold     = static_cast<int32_t>(v); break;
+      case 'f': param.FragmentThresholdRate = v; break;
+      case 'x': param.MaxChopLength         = static_cast<int32_t>(v); break;
+      case 'a': param.MarginParameter       = v; break;
+      }
+    }
+    std::ostringstream oss;
+    oss<<"k="<<param.CoverageThreshold<<",f="<<param.FragmentThresholdRate<<",x="<<param.MaxChopLength<<",a="<<param.MarginParameter;
+    param.Tag = oss.str();
+    m_parameter_sets.push_back(param);
+    // Next grid point
+    int32_t i=3;
+    for(;i>=0;--i){
+      if(index[i]==~0U) continue;
+      if(++index[i]<values[i].size()) break;
+      index[i]=0;
+    }
+    if(i<0) break;
+  }
+  std::cerr<<"# parameter sweep: "<<m_parameter_sets.size()<<" parameter sets"<<std::endl;
+}
+
+// Number of bases in [MinPosition(),MaxPosition()] with each coverage up to limit,
+// where the last one counts coverage at or above limit
+void CCoverageArray::BaseHistogram(uint32_t limit, std::vector<int64_t>* histogram) const{
+  CCoverageHistogram::Bases(m_coverage,std::max<int64_t>(MinPosition(),0),MaxPosition()+1,limit,m_n_threads,histogram);
+}
+
+void CCoverageArray::ShowCoverageDistribution(std::ostream &stream){
   uint32_t coverage_upper_bound = Option().RequireInteger("coverage-upper-bound");
+  std::vector<int64_t> coverage_distribution;
+  BaseHistogram(std::min<uint32_t>(m_max_coverage,coverage_upper_bound),&coverage_distribution);
+  // If the upper bound is reached, the last line sums up coverage beyond it
   for(uint32_t i=0;i<coverage_distribution.size();++i){
-    if(i>=coverage_upper_bound){
-      int64_t c=0;
-      for(uint32_t j=i;j<coverage_distribution.size();++j) c+=m_coverage[j];
-      stream<<"D\t"<<i<<"\t"<<c<<std::endl;
-      break;
-    }
     stream<<"D\t"<<i<<"\t"<<coverage_distribution[i]<<std::endl;
   }
 }
@@ -96,59 +207,268 @@ void CCoverageArray::ShowCoverageDistribution(std::ostream &stream){
 void CCoverageArray::SetUp(int32_t chrNo){
   CSAMReader::SetUp(chrNo);
 
-  // Get array
-  m_coverage = new uint16_t[GenomeSize()+1];
-  for(int64_t i=0;i<=GenomeSize();++i) m_coverage[i]=0;
+  // The coverage array is allocated by ReadSAM() or RefineWhileReading()
+  m_coverage.Release();
+  ReleaseLanes();
+  m_run_indexes.clear();
+  m_is_streaming=false;
 
-  // Coverage threshold
-  m_coverage_threshold = Option().RequireInteger("coverage-threshold");
   m_max_coverage=0;
   //m_ margin_size = Option().RequireInteger("margin-size");
-  m_margin_parameter = Option().RequireInteger("margin-parameter");
-  m_fragment_threshold_rate = Option().RequireDouble("fragment-threshold");
 }
 
-void CCoverageArray::RefineByCoverage(std::vector<int64_t> *regions, int64_t front_pos, int64_t back_pos) const{
-  assert(regions);
-  assert(front_pos<=back_pos);
-  for(int64_t i=front_pos;i<=back_pos;++i){
-    if((regions->size() & 1)==0 && m_coverage[i]<m_coverage_threshold){
-      regions->push_back(i);
-    }else if((regions->size() & 1)==1 && m_coverage[i]>=m_coverage_threshold){
-      // Close the latest region
-      regions->push_back(i);
+////////////////////////////////////////////////////////////////////////////////
+// Run index
+void CCoverageRunIndex::Build(const coverage_counter_t& coverage, uint32_t threshold){
+  m_coverage=&coverage;
+  m_boundary.clear();
+  m_cumulative.clear();
+  int64_t size=coverage.Size();
+  m_first_above = size>0 && coverage.Get(0)>=threshold;
+  bool above=m_first_above;
+  int64_t sum=0;
+  for(int64_t p=0;p<size;above=!above){
+    int64_t q=coverage.FindForward(p,size,threshold,!above);
+    m_boundary.push_back(p);
+    m_cumulative.push_back(sum);
+    sum+=coverage.Sum(p,q);
+    p=q;
+  }
+  m_boundary.push_back(size);
+  m_cumulative.push_back(sum);
+}
+
+// Index of the run that contains p
+int64_t CCoverageRunIndex::Run(int64_t p) const{
+  Assert(0<=p && p<m_boundary.back());
+  return std::upper_bound(m_boundary.begin(),m_boundary.end(),p)-m_boundary.begin()-1;
+}
+
+// Coverage summed over [0,p)
+int64_t CCoverageRunIndex::Prefix(int64_t p) const{
+  if(p>=m_boundary.back()) return m_cumulative.back();
+  int64_t k=Run(p);
+  return m_cumulative[k]+m_coverage->Sum(m_boundary[k],p);
+}
+
+// Same as CCoverageArray::FindCrossing(), jumping to the next run instead of scanning
+int64_t CCoverageRunIndex::FindCrossing(int64_t from, int64_t to, int32_t direction, bool above) const{
+  if(direction>0){
+    if(from>=to) return to;
+    int64_t k=Run(from);
+    return std::min(to, Above(k)==above? from: m_boundary[k+1]);
+  }else{
+    if(from<=to) return to;
+    int64_t k=Run(from);
+    return std::max(to, Above(k)==above? from: m_boundary[k]-1);
+  }
+}
+
+int64_t CCoverageRunIndex::SumBetween(int64_t from, int64_t to, int32_t direction) const{
+  if(direction>0) return Prefix(to)-Prefix(from);
+  return Prefix(from+1)-Prefix(to+1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Histograms
+struct CCoverageHistogram::job_t {
+  const coverage_counter_t* Coverage;
+  int64_t From;
+  int64_t NSteps;   // The range is [From,From+NSteps*Step), clipped at To
+  int64_t Step;
+  int64_t To;
+  int32_t NThreads;
+  uint32_t Limit;
+  int64_t Unit;
+  int64_t NIndexes;
+  std::vector<std::vector<int64_t> > Histograms; // per thread
+  std::vector<bins_t> Bins;                      // per thread
+  // Steps [first,last) of a thread
+  inline int64_t First(int32_t t) const {return NSteps*t/NThreads;}
+  inline int64_t Last (int32_t t) const {return NSteps*(t+1)/NThreads;}
+};
+
+void CCoverageHistogram::BasesWorker(void* arg, int32_t thread_id){
+  job_t* job = static_cast<job_t*>(arg);
+  int64_t from = job->From+job->First(thread_id)*job->Step;
+  int64_t to   = std::min(job->To,job->From+job->Last(thread_id)*job->Step);
+  std::vector<int64_t>& histogram = job->Histograms[thread_id];
+  histogram.assign(job->Limit+1,0);
+  if(from<to) job->Coverage->CountValues(from,to,job->Limit,&histogram[0]);
+}
+
+// Number of bases in [from,to) with each coverage; coverage at or above limit is counted at limit.
+void CCoverageHistogram::Bases(const coverage_counter_t& coverage, int64_t from, int64_t to, uint32_t limit, int32_t n_threads, std::vector<int64_t>* histogram){
+  histogram->assign(limit+1,0);
+  if(from>=to) return;
+  job_t job;
+  job.Coverage=&coverage;
+  job.From=from;
+  job.To=to;
+  job.Step=coverage_counter_t::BLOCK_SIZE;
+  job.NSteps=(to-from+job.Step-1)/job.Step;
+  job.NThreads=std::max<int32_t>(1,std::min<int64_t>(n_threads,job.NSteps));
+  job.Limit=limit;
+  job.Histograms.resize(job.NThreads);
+  CThreadGroup threads;
+  threads.Run(job.NThreads,BasesWorker,&job);
+  for(int32_t t=0;t<job.NThreads;++t){
+    for(uint32_t i=0;i<=limit;++i) (*histogram)[i]+=job.Histograms[t][i];
+  }
+}
+
+void CCoverageHistogram::BinsWorker(void* arg, int32_t thread_id){
+  job_t* job = static_cast<job_t*>(arg);
+  bins_t& bins = job->Bins[thread_id];
+  bins.Total=0;
+  for(int64_t j=job->First(thread_id);j<job->Last(thread_id);++j){
+    int64_t window = job->From+j*job->Step;
+    uint64_t b = job->Coverage->Sum(window,window+job->Step);
+    bins.Total += b;
+    int64_t index = b/job->Unit;
+    if(index>=job->NIndexes){
+      bins.Overflow.push_back(window);
+      bins.OverflowSum.push_back(b);
+      continue;
     }
+    // Grown as needed, so that memory follows the coverage actually seen
+    if(index>=sign_cast<int64_t>(bins.Frequency.size())) bins.Frequency.resize(index+1,0);
+    ++bins.Frequency[index];
+  }
+}
+
+// Bins of bin_size bases starting at from, counted by (sum of coverage)/unit.
+// Sums whose index reaches n_indexes are listed in Overflow instead.
+void CCoverageHistogram::Bins(const coverage_counter_t& coverage, int64_t from, int64_t n_bins, int64_t bin_size, int64_t unit, int64_t n_indexes, int32_t n_threads, bins_t* bins){
+  if(bin_size<=0) Quit("Invalid bin size: "<<bin_size);
+  if(unit<=0) Quit("Invalid coverage unit: "<<unit);
+  bins->Frequency.clear();
+  bins->Overflow.clear();
+  bins->OverflowSum.clear();
+  bins->Total=0;
+  bins->NBins=std::max<int64_t>(n_bins,0);
+  if(n_bins<=0) return;
+  job_t job;
+  job.Coverage=&coverage;
+  job.From=from;
+  job.Step=bin_size;
+  job.NSteps=n_bins;
+  job.To=from+n_bins*bin_size;
+  job.NThreads=std::max<int32_t>(1,std::min<int64_t>(n_threads,n_bins));
+  job.Unit=unit;
+  job.NIndexes=n_indexes;
+  job.Bins.resize(job.NThreads);
+  CThreadGroup threads;
+  threads.Run(job.NThreads,BinsWorker,&job);
+  for(int32_t t=0;t<job.NThreads;++t){
+    const bins_t& b = job.Bins[t];
+    if(b.Frequency.size()>bins->Frequency.size()) bins->Frequency.resize(b.Frequency.size(),0);
+    for(uint32_t i=0;i<b.Frequency.size();++i) bins->Frequency[i]+=b.Frequency[i];
+    bins->Overflow.insert(bins->Overflow.end(),b.Overflow.begin(),b.Overflow.end());
+    bins->OverflowSum.insert(bins->OverflowSum.end(),b.OverflowSum.begin(),b.OverflowSum.end());
+    bins->Total+=b.Total;
+  }
+}
+
+// Run index of a threshold, built at its first use and shared by all threads.
+// It is available only when the coverage of the whole chromosome is final,
+// and only when RefineRegion() expects it to be reused (see RUN_INDEX_MIN_CALLS).
+const CCoverageRunIndex* CCoverageArray::RunIndex(uint32_t threshold) const{
+  if(!m_use_run_index || !m_coverage.HasSummary()) return 0;
+  CLock lock(m_run_index_mutex);
+  std::map<uint32_t,CCoverageRunIndex>::iterator it = m_run_indexes.find(threshold);
+  if(it==m_run_indexes.end()){
+    it = m_run_indexes.insert(std::make_pair(threshold,CCoverageRunIndex())).first;
+    it->second.Build(m_coverage,threshold);
+    if(Option().Find("verbose")) std::cerr<<"# run index: threshold="<<threshold<<", "<<it->second.NRuns()<<" runs"<<std::endl;
   }
+  return &it->second;
+}
+
+// Coverage is an integer, so c<t is equivalent to c<ceil(t).
+uint32_t CCoverageArray::CrossingThreshold(double threshold){
+  if(threshold<=0) return 0;
+  if(threshold>=std::numeric_limits<uint32_t>::max()) return std::numeric_limits<uint32_t>::max();
+  return static_cast<uint32_t>(std::ceil(threshold));
+}
+
+void CCoverageArray::RefineByCoverage(std::vector<int64_t> *regions, int64_t front_pos, int64_t back_pos, const refine_parameter_t& param) const{
+  assert(regions);
+  assert(front_pos<=back_pos);
+  uint32_t threshold=CrossingThreshold(param.CoverageThreshold);
+  const CCoverageRunIndex* runs=RunIndex(threshold);
   int64_t end_pos=back_pos+1;
+  for(int64_t i=front_pos;i<end_pos;){
+    i=FindCrossing(runs,i,end_pos,1,threshold,false);
+    if(i==end_pos) break;
+    regions->push_back(i);
+    // Close the latest region
+    i=FindCrossing(runs,i,end_pos,1,threshold,true);
+    if(i==end_pos) break;
+    regions->push_back(i);
+  }
   if((regions->size()&1)!=0) regions->push_back(end_pos);
 }
 
-bool CCoverageArray::CoverageDistribution(int64_t front_pos, int64_t back_pos, int64_t w, CCoverageDistribution *covdist, double my_coverage) const{
-  Assert(covdist);
+////////////////////////////////////////////////////////////////////////////////
+// Coverage windows
+// Positions out of a whole-chromosome array count as no coverage; a ring
+// buffer is indexed by positions as they are.
+void CCoverageWindowSums::Build(const coverage_counter_t& coverage, int64_t from, int64_t to){
+  m_from=from;
+  m_prefix.assign(std::max<int64_t>(to-from,0)+1,0);
+  const bool is_ring = coverage.Mask()!=~static_cast<int64_t>(0);
+  uint64_t s=0;
+  for(int64_t p=from;p<to;++p){
+    if(0<=p && (is_ring || p<coverage.Size())) s+=coverage.Get(p);
+    m_prefix[p-from+1]=s;
+  }
+}
+
+// Means, truncated to integers, of the windows of a width that start in [from,to-width)
+void CCoverageWindowSums::Means(int64_t from, int64_t to, int64_t width, std::vector<int32_t>* means) const{
+  Assert(Covers(from,to));
+  means->clear();
+  if(width<=0 || to-from<=width) return;
+  int64_t n=to-from-width;
+  means->resize(n);
+  const uint64_t* head=&m_prefix[from-m_from];
+  const uint64_t* tail=head+width;
+  double w=width;
+  for(int64_t i=0;i<n;++i) (*means)[i]=static_cast<int32_t>((tail[i]-head[i])/w);
+}
+
+// "C" record of the distribution of window means of width w in [front_pos,back_pos],
+// from the sums built for the edge under refinement
+bool CCoverageArray::CoverageDistribution(const refine_context_t& ctx, int64_t front_pos, int64_t back_pos, int64_t w, double my_coverage, const CCoverageWindowSums& sums) const{
   if(s_window_size<=0) return true; // If window is not used, do nothing.
-  //return true;
-  std::cout<<"C\t"<<front_pos<<'\t'<<back_pos<<'\t'<<w<<'\t'<<my_coverage<<'\t';
+  CCoverageDistribution *covdist = ctx.CovDist;
+  Assert(covdist);
+  std::ostream& stream = *ctx.Window;
+  int64_t from=std::min(front_pos,back_pos);
+  int64_t to=std::max(front_pos,back_pos)+1;
 
   covdist->Initialize();
-  if(front_pos>back_pos){int64_t x=front_pos; front_pos=back_pos; back_pos=x;}
-  double c=0;
-  int64_t len=back_pos-front_pos+1;
-  // First w-1 bases
-  int32_t i=0;
-  for(;i<w;++i) c+=m_coverage[front_pos+i];
-  // Rest len-w+1 bases
-  for(;i<len;++i){
-    covdist->Increment(c/w);
-    c+=m_coverage[front_pos+i];
-    c-=m_coverage[front_pos+i-w];
-  }
-
-  covdist->Write(std::cout);
-  std::cout<<std::endl;
+  std::vector<int32_t> means;
+  sums.Means(from,to,w,&means);
+  for(uint32_t i=0;i<means.size();++i) covdist->Increment(means[i]);
+
+  if(m_window_binary){
+    int64_t x[3]={front_pos,back_pos,w};
+    stream.put('C');
+    stream.write(reinterpret_cast<const char*>(x),sizeof(x));
+    stream.write(reinterpret_cast<const char*>(&my_coverage),sizeof(my_coverage));
+    covdist->WriteBinary(stream);
+  }else{
+    // No flush per line; the stream is flushed when the output ends
+    stream<<"C\t"<<front_pos<<'\t'<<back_pos<<'\t'<<w<<'\t'<<my_coverage<<'\t';
+    covdist->Write(stream);
+    stream<<'\n';
+  }
   return true;
 }
 
-int64_t CCoverageArray::RefineOneSide(int64_t front_pos, int64_t back_pos, refine_type_t rt) const{
+int64_t CCoverageArray::RefineOneSide(const refine_context_t& ctx, int64_t front_pos, int64_t back_pos, refine_type_t rt, const refine_parameter_t& param) const{
   int32_t direction = 1;
   int64_t lower_limit=front_pos;
   int64_t upper_limit=back_pos;
@@ -157,20 +477,28 @@ int64_t CCoverageArray::RefineOneSide(int64_t front_pos, int64_t back_pos, refin
     lower_limit=back_pos;
     upper_limit=front_pos;
   }
-  double coverage_threshold=m_coverage_threshold;
-  dT("1:coverage_threshold="<<coverage_threshold<<"("<<m_coverage_threshold<<")");
+  double coverage_threshold=param.CoverageThreshold;
+  dT("1:coverage_threshold="<<coverage_threshold<<"("<<param.CoverageThreshold<<")");
   if(MarginSize()>0){
-    std::cerr
+    *ctx.Log
       <<"target: "
       <<front_pos<<'\t'<<back_pos<<'\t'<<front_pos-direction<<'\t'<<front_pos-direction*MarginSize()<<std::endl;
     coverage_threshold = CoverageIn(front_pos-direction,front_pos-direction*MarginSize());
-    coverage_threshold *= m_margin_parameter; // CHECK, FIXIT
+    coverage_threshold *= param.MarginParameter; // CHECK, FIXIT
   }
 
-  dT("2:coverage_threshold="<<coverage_threshold<<"("<<m_coverage_threshold<<")");
+  dT("2:coverage_threshold="<<coverage_threshold<<"("<<param.CoverageThreshold<<")");
+  uint32_t threshold=CrossingThreshold(coverage_threshold);
+  const CCoverageRunIndex* runs=RunIndex(threshold);
+  int64_t limit_pos=(direction>0? upper_limit+1: lower_limit-1);
   // First, truncate contiguous high coverage region.
-  for(;front_pos!=back_pos && m_coverage[front_pos]>=coverage_threshold;front_pos+=direction);
+  front_pos=FindCrossing(runs,front_pos,back_pos,direction,threshold,false);
   int64_t x=front_pos;
+  // Windows next to the edge are the same for every fragment; only their width changes
+  int64_t window_front=front_pos-direction;
+  int64_t window_back =front_pos-direction*(s_window_size-1);
+  CCoverageWindowSums sums;
+  if(s_window_size>0) sums.Build(m_coverage,std::min(window_front,window_back),std::max(window_front,window_back)+1);
   // Then, truncate gap-high coverage regions.
   dT("first_x="<<x);
   while((back_pos-x)*direction>=0){
@@ -179,46 +507,52 @@ int64_t CCoverageArray::RefineOneSide(int64_t front_pos, int64_t back_pos, refin
     dT("front="<<front_pos<<", back_pos="<<back_pos);
     if(x==back_pos) break;
     dT("Skipping low cov region");
-    for(;lower_limit<=x && x<=upper_limit && m_coverage[x]< coverage_threshold;x+=direction) c+=m_coverage[x]; // skip gap
+    int64_t y=FindCrossing(runs,x,limit_pos,direction,threshold,true); // skip gap
+    c+=SumBetween(runs,x,y,direction);
+    x=y;
     if(x==back_pos) break;
     dT("Skipping high cov region");
-    for(;lower_limit<=x && x<=upper_limit && m_coverage[x]>=coverage_threshold;x+=direction) c+=m_coverage[x]; // skip next region
+    y=FindCrossing(runs,x,limit_pos,direction,threshold,false); // skip next region
+    c+=SumBetween(runs,x,y,direction);
+    x=y;
     double w = (x-fragment_begin)*direction;
     dT("[fragment_begin,x]=["<<fragment_begin<<","<<x<<"]"<<back_pos);
     if(w==0) break;
     dT("w="<<w<<", not zero.");
     assert(w>1);
     //if(c/w<f_threshold){x=fragment_begin; break;} // Discard the last thin region
-    CoverageDistribution(front_pos-direction, front_pos-direction*(s_window_size-1), w, &m_covdist, c/w);
-    dT("c/w="<<c<<"/"<<w<<"="<<c/w<<", rate*cov_thr="<<m_fragment_threshold_rate<<"*"<<coverage_threshold<<"="<<m_fragment_threshold_rate*coverage_threshold);
-    if(c/w<m_fragment_threshold_rate*coverage_threshold){x=fragment_begin; break;} // Discard the last thin region
+    CoverageDistribution(ctx, window_front, window_back, w, c/w, sums);
+    dT("c/w="<<c<<"/"<<w<<"="<<c/w<<", rate*cov_thr="<<param.FragmentThresholdRate<<"*"<<coverage_threshold<<"="<<param.FragmentThresholdRate*coverage_threshold);
+    if(c/w<param.FragmentThresholdRate*coverage_threshold){x=fragment_begin; break;} // Discard the last thin region
   }
   dT("x="<<x);
   return x;
 }
 
-void CCoverageArray::RefineEdge(std::vector<int64_t> *regions, int64_t front_pos, int64_t back_pos, refine_type_t rt) const{
+void CCoverageArray::RefineEdge(const refine_context_t& ctx, std::vector<int64_t> *regions, int64_t front_pos, int64_t back_pos, refine_type_t rt, const refine_parameter_t& param) const{
   assert(regions);
   if(front_pos>back_pos){
     // CHECK
-    Warning("Degenerage region: "<<front_pos<<">"<<back_pos);
+    *ctx.Log<<"Warning: Degenerage region: "<<front_pos<<">"<<back_pos<<std::endl;
     return;
   }
   int64_t b=front_pos;
   int64_t e=back_pos;
-  if(MarginSize()>0) std::cerr<<"Warning: margine-size("<<MarginSize()<<") was ignored in initial clipping.\n";
-  while(b<=back_pos  && m_coverage[b]>=m_coverage_threshold) ++b;
-  while(e>=front_pos && m_coverage[e]>=m_coverage_threshold) --e;
+  if(MarginSize()>0) *ctx.Log<<"Warning: margine-size("<<MarginSize()<<") was ignored in initial clipping.\n";
+  uint32_t threshold=CrossingThreshold(param.CoverageThreshold);
+  const CCoverageRunIndex* runs=RunIndex(threshold);
+  b=FindCrossing(runs,b,back_pos+1, 1,threshold,false);
+  e=FindCrossing(runs,e,front_pos-1,-1,threshold,false);
   if(b<e){
-    b=RefineOneSide(b,e,rt);
-    e=RefineOneSide(e,b,rt);
-    if(m_max_chop_length>0){
-      if(b-front_pos>m_max_chop_length){
-        std::cerr<<"# Canceling ["<<b<<",*], return to ["<<front_pos<<",*]\n";
+    b=RefineOneSide(ctx,b,e,rt,param);
+    e=RefineOneSide(ctx,e,b,rt,param);
+    if(param.MaxChopLength>0){
+      if(b-front_pos>param.MaxChopLength){
+        *ctx.Log<<"# Canceling ["<<b<<",*], return to ["<<front_pos<<",*]\n";
         b=front_pos;
       }
-      if(back_pos-e>m_max_chop_length){
-        std::cerr<<"# Canceling [*,"<<e<<"], return to [*,"<<back_pos<<"]\n";
+      if(back_pos-e>param.MaxChopLength){
+        *ctx.Log<<"# Canceling [*,"<<e<<"], return to [*,"<<back_pos<<"]\n";
         e=back_pos;
       }
     }
@@ -240,21 +574,21 @@ double CCoverageArray::CoverageIn(int64_t front_pos, int64_t back_pos) const {
   }
 
   // Calculate coverage in this region
-  int64_t coverage_integer=0;
-  for(int64_t i=front_pos;i<=back_pos;++i) coverage_integer += m_coverage[i];
+  int64_t coverage_integer=m_coverage.Sum(front_pos,back_pos+1);
   double coverage_double = coverage_integer;
   coverage_double /= back_pos-front_pos+1;
   return coverage_double;
 }
 
-void WriteRefinedBED(std::ostream& stream, int32_t chr, int64_t front_pos, int64_t back_pos, int64_t refined_front_pos=-1, int64_t refined_back_pos=-1){
+void WriteRefinedBED(std::ostream& stream, int32_t chr, const std::string& tag, int64_t front_pos, int64_t back_pos, int64_t refined_front_pos=-1, int64_t refined_back_pos=-1){
   if(refined_front_pos<0) refined_front_pos=front_pos;
   if(refined_back_pos <0) refined_back_pos =back_pos;
   stream<<"chr"<<chr
         <<'\t'<<front_pos-1
         <<'\t'<<back_pos
-        <<'\t'<<"refined"
-        <<'\t'<<1
+        <<'\t'<<"refined";
+  if(!tag.empty()) stream<<':'<<tag;
+  stream<<'\t'<<1
         <<'\t'<<'+'
         <<'\t'<<refined_front_pos-1
         <<'\t'<<refined_back_pos
@@ -262,91 +596,499 @@ void WriteRefinedBED(std::ostream& stream, int32_t chr, int64_t front_pos, int64
         <<std::endl;
 }
 
-void CCoverageArray::AnalyzeRegion(std::ostream &stream, int32_t no, int64_t front_pos, int64_t back_pos, refine_type_t rt) const{
+void CCoverageArray::AnalyzeRegion(std::ostream &stream, const refine_context_t& ctx, int32_t no, int64_t front_pos, int64_t back_pos, refine_type_t rt) const{
   double coverage_double = CoverageIn(front_pos,back_pos);
   Assert(front_pos<=back_pos);
   //if(coverage_double==0) return; // remove this line.
-  if(coverage_double==0){
-    if(!m_output_format) return;
-    if(std::strcmp("bed",m_output_format)!=0) return;
-    WriteRefinedBED(stream,MyChr(),front_pos,back_pos);
-    return;
-  }
-  std::vector<int64_t> region;
-  if(m_refinement_coverage_threshold>0 && coverage_double>m_refinement_coverage_threshold){
-    std::cerr<<"# Skipping ["<<front_pos<<","<<back_pos<<"]: threshold="<<m_refinement_coverage_threshold<<", coverage="<<coverage_double<<std::endl;
-    // No change
-    region.push_back(front_pos);
-    region.push_back(back_pos);
-  }else{
-    // Calculate split regions
-    switch(rt){
-    case REFINE_COVERAGE:        RefineByCoverage(&region,front_pos,back_pos); break;
-    case REFINE_EDGE:            RefineEdge(&region,front_pos,back_pos,rt); break;
-    case REFINE_FRAGMENTED_EDGE: RefineEdge(&region,front_pos,back_pos,rt); break;
-    default:
-      Quit("Unexpected refine_type: "<<rt);
-    }
-  }
-  // Write the result
-  if(! *m_output_format){
-    stream<<"V\t"<<no<<'\t'<<coverage_double<<"\t["<<front_pos<<","<<back_pos+1<<")\t";
-    for(uint32_t i=0;i<region.size();i+=2){
-      if(i>0) stream<<' ';
-      stream<<region[i]<<'-'<<region[i+1];
+  foreach_const(std::vector<refine_parameter_t>, param, m_parameter_sets){
+    if(coverage_double==0){
+      if(!m_output_format) return;
+      if(std::strcmp("bed",m_output_format)!=0) return;
+      WriteRefinedBED(stream,MyChr(),param->Tag,front_pos,back_pos);
+      continue;
     }
-    stream<<std::endl;
-  }else if( !std::strcmp("bed",m_output_format) ){
-    double rate = 0;
-    if(! region.empty()){
-      int32_t len=back_pos-front_pos;
-      Assert(len>=0); //if(len<0) rate *= -1;
-      Assert(region.size()==2);
-      len+=1;
-      rate = static_cast<double>(region[1]-region[0]+1)/len;
+    std::vector<int64_t> region;
+    if(m_refinement_coverage_threshold>0 && coverage_double>m_refinement_coverage_threshold){
+      *ctx.Log<<"# Skipping ["<<front_pos<<","<<back_pos<<"]: threshold="<<m_refinement_coverage_threshold<<", coverage="<<coverage_double<<std::endl;
+      // No change
+      region.push_back(front_pos);
+      region.push_back(back_pos);
+    }else{
+      // Calculate split regions
+      switch(rt){
+      case REFINE_COVERAGE:        RefineByCoverage(&region,front_pos,back_pos,*param); break;
+      case REFINE_EDGE:            RefineEdge(ctx,&region,front_pos,back_pos,rt,*param); break;
+      case REFINE_FRAGMENTED_EDGE: RefineEdge(ctx,&region,front_pos,back_pos,rt,*param); break;
+      default:
+        Quit("Unexpected refine_type: "<<rt);
+      }
     }
-    if(region.empty()){
-      WriteRefinedBED(stream,MyChr(),front_pos,back_pos);
+    // Write the result
+    if(! *m_output_format){
+      stream<<"V\t"<<no<<'\t'<<coverage_double<<"\t["<<front_pos<<","<<back_pos+1<<")\t";
+      for(uint32_t i=0;i<region.size();i+=2){
+        if(i>0) stream<<' ';
+        stream<<region[i]<<'-'<<region[i+1];
+      }
+      // Average coverage of each sample
+      for(uint32_t k=0;k<m_lanes.size();++k){
+        stream<<(k==0? "\t": ",")<<static_cast<double>(m_lanes[k]->Sum(front_pos,back_pos+1))/(back_pos-front_pos+1);
+      }
+      if(!param->Tag.empty()) stream<<'\t'<<param->Tag;
+      stream<<std::endl;
+    }else if( !std::strcmp("bed",m_output_format) ){
+      double rate = 0;
+      if(! region.empty()){
+        int32_t len=back_pos-front_pos;
+        Assert(len>=0); //if(len<0) rate *= -1;
+        Assert(region.size()==2);
+        len+=1;
+        rate = static_cast<double>(region[1]-region[0]+1)/len;
+      }
+      if(region.empty()){
+        WriteRefinedBED(stream,MyChr(),param->Tag,front_pos,back_pos);
+      }else{
+        WriteRefinedBED(stream,MyChr(),param->Tag,front_pos,back_pos,region[0],region[1]);
+      }
     }else{
-      WriteRefinedBED(stream,MyChr(),front_pos,back_pos,region[0],region[1]);
+      Quit("Unknown output format: "<<m_output_format);
     }
-  }else{
-    Quit("Unknown output format: "<<m_output_format);
   }
 }
 
+CCoverageArray::refine_context_t CCoverageArray::SerialContext(){
+  refine_context_t ctx;
+  ctx.Window=m_window_stream;
+  ctx.Log=m_log_stream;
+  ctx.CovDist=&m_covdist;
+  return ctx;
+}
+
 void CCoverageArray::RefineRegion(std::ostream &stream, refine_type_t rt, CGeneralFeatureVector& variants){
   if(variants.empty()) Quit("Empty variation sets");
   std::sort(variants.begin(),variants.end());
+  // Thresholds depend on each call with margins, so an index would be used only once
+  m_use_run_index = MarginSize()==0 && (m_parameter_sets.size()>1 || variants.size()>=RUN_INDEX_MIN_CALLS);
+  if(m_n_threads>1 && variants.size()>1){
+    RefineRegionInParallel(stream,rt,variants,m_n_threads);
+    return;
+  }
+  refine_context_t ctx = SerialContext();
   for(uint32_t i=0;i<variants.size();++i){
     const CGeneralFeature& var = variants[i];
-    AnalyzeRegion(stream,i,var.Start(),var.End(),rt);
+    AnalyzeRegion(stream,ctx,i,var.Start(),var.End(),rt);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Parallel refinement
+// Variants are refined in batches. Every variant writes to its own buffers,
+// which are flushed in the sorted order after the batch, so the output is
+// the same as the serial refinement whatever the number of threads.
+struct CCoverageArray::parallel_refinement_t {
+  const CCoverageArray* Array;
+  refine_type_t Type;
+  const CGeneralFeatureVector* Variants;
+  bool SharedWindow; // "C" lines go to the same stream as the results
+  uint32_t Begin;
+  uint32_t End;
+  volatile uint32_t Next;
+  std::vector<std::string> Out;
+  std::vector<std::string> Window;
+  std::vector<std::string> Log;
+};
+
+void CCoverageArray::RefineWorker(void* arg, int32_t thread_id){
+  parallel_refinement_t* pr = static_cast<parallel_refinement_t*>(arg);
+  CCoverageDistribution covdist;
+  for(;;){
+    uint32_t i = __sync_fetch_and_add(&pr->Next,1);
+    if(i>=pr->End) break;
+    std::ostringstream out, window, log;
+    refine_context_t ctx;
+    ctx.Window = pr->SharedWindow? &out: &window;
+    ctx.Log = &log;
+    ctx.CovDist = &covdist;
+    const CGeneralFeature& var = (*pr->Variants)[i];
+    pr->Array->AnalyzeRegion(out,ctx,i,var.Start(),var.End(),pr->Type);
+    uint32_t k = i-pr->Begin;
+    pr->Out[k] = out.str();
+    pr->Window[k] = window.str();
+    pr->Log[k] = log.str();
+  }
+}
+
+void CCoverageArray::RefineRegionInParallel(std::ostream &stream, refine_type_t rt, const CGeneralFeatureVector& variants, int32_t n_threads){
+  static const uint32_t BATCH_PER_THREAD=1024;
+  if(Option().Find("verbose")) std::cerr<<"# refining "<<variants.size()<<" variants on "<<n_threads<<" threads"<<std::endl;
+  parallel_refinement_t pr;
+  pr.Array=this;
+  pr.Type=rt;
+  pr.Variants=&variants;
+  pr.SharedWindow=(&stream==m_window_stream);
+  CThreadGroup threads;
+  for(uint32_t begin=0;begin<variants.size();begin+=BATCH_PER_THREAD*n_threads){
+    pr.Begin=pr.Next=begin;
+    pr.End=std::min<uint32_t>(begin+BATCH_PER_THREAD*n_threads,variants.size());
+    pr.Out.assign(pr.End-pr.Begin,std::string());
+    pr.Window.assign(pr.End-pr.Begin,std::string());
+    pr.Log.assign(pr.End-pr.Begin,std::string());
+    threads.Run(std::min<uint32_t>(n_threads,pr.End-pr.Begin),RefineWorker,&pr);
+    for(uint32_t k=0;k<pr.Out.size();++k){
+      (*m_log_stream)<<pr.Log[k];
+      (*m_window_stream)<<pr.Window[k];
+      stream<<pr.Out[k];
+    }
   }
 }
 
 /*
 int64_t CCoverageArray::MinPosition() const {
     int64_t min_position=0;
-    while(m_coverage[min_position]==0 && min_position<=MaxPosition()) ++min_position;
+    while(Coverage(min_position)==0 && min_position<=MaxPosition()) ++min_position;
     return min_position;
 }
 */
 
+void CCoverageArray::AllocateCoverage(int64_t size, int64_t mask){
+  m_coverage.Allocate(size,mask);
+  m_ring_base=0;
+}
+
 void CCoverageArray::ReadSAM(const char *sam_file, CChromosomeNormalizer& normalizer){
-  CSAMReader::ReadSAM(sam_file,normalizer);
+  ReadSAM(std::vector<const char*>(1,sam_file),normalizer);
+}
+
+// Coverage of all inputs is summed; refinement uses the sum.
+void CCoverageArray::ReadSAM(const std::vector<const char*>& sam_files, CChromosomeNormalizer& normalizer){
+  if(sam_files.empty()) Quit("No alignment file");
+  int32_t width = 8*sizeof(coverage_counter_t::narrow_type);
+  bool keep_lanes = Option().Find("sample-lanes");
+  ReleaseLanes();
+  const char *cache_dir = Option().Find("coverage-cache");
+  if(keep_lanes && cache_dir && *cache_dir) Warning("Coverage cache is not used with --sample-lanes");
+  if(!keep_lanes && m_cache.SetUp(sam_files,normalizer.Source(),MyChr(),GenomeSize(),width) && LoadCache()){
+    if(Option().Find("verbose")) std::cerr<<"# coverage was loaded from "<<m_cache.Path()<<std::endl;
+  }else{
+    if(sam_files.size()==1 && !keep_lanes){
+      if(m_coverage.Empty()) AllocateCoverage(GenomeSize()+1,~static_cast<int64_t>(0));
+      CSAMReader::ReadSAM(sam_files.front(),normalizer);
+    }else{
+      ReadInParallel(sam_files,normalizer,keep_lanes);
+    }
+    if(m_cache.Enabled()) SaveCache();
+  }
+  FinishReading();
+}
+
+void CCoverageArray::FinishReading(){
+  // Coverage is final; let crossing searches skip blocks that cannot cross a threshold
+  m_coverage.BuildSummary();
+  m_run_indexes.clear();
   m_average_density =  m_read_positions.NReads();
   m_average_density /= MaxPosition()-MinPosition();
   if(Option().Find("verbose")){
     std::cerr<<"# max_coverage="<<m_max_coverage<<std::endl;
+    std::cerr<<"# coverage counters: "<<8*sizeof(coverage_counter_t::narrow_type)<<" bits, "<<m_coverage.NWideBlocks()<<" widened blocks, "<<m_coverage.MemoryUsage()<<" bytes, backing="<<m_coverage.Backing()<<std::endl;
+    std::cerr<<"# block summary: "<<m_coverage.SummaryMemoryUsage()<<" bytes"<<std::endl;
+    std::cerr<<"# read index: "<<m_read_positions.NReads()<<" reads, "<<m_read_positions.MemoryUsage()<<" bytes"<<std::endl;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Whole genome in one pass
+// The coverage array of a chromosome is allocated when its first alignment
+// is read, refined against the calls on it when the next chromosome starts,
+// and released. Chromosomes that have calls but no alignment are refined
+// with empty coverage at the end, in the same way as a run of that chromosome.
+void CCoverageArray::RefineAllChromosomes(std::ostream &stream, refine_type_t rt, const CGeneralFeatureVector& variants, const char *sam_file, CChromosomeNormalizer& normalizer){
+  if(variants.empty()) Quit("Empty variation sets");
+  if(!AllChromosomes()) Quit("SetUp(CChromosomeNormalizer::ALL_CHROMOSOMES) is required");
+  m_variants_by_chr.clear();
+  std::map<int32_t,std::string> refname;
+  foreach_const(CGeneralFeatureVector, var, variants){
+    int32_t chr = normalizer.Chr(var->Name());
+    m_variants_by_chr[chr].push_back(*var);
+    refname[chr] = var->Name();
+  }
+  m_genome_stream=&stream;
+  m_genome_refine_type=rt;
+  CSAMReader::ReadSAM(sam_file,normalizer);
+
+  // Chromosomes without alignments
+  for(std::map<int32_t,CGeneralFeatureVector>::iterator it=m_variants_by_chr.begin();it!=m_variants_by_chr.end();++it){
+    if(it->second.empty()) continue;
+    StartChromosome(it->first,refname[it->first].c_str());
+    FinishChromosome();
+  }
+  m_genome_stream=0;
+}
+
+void CCoverageArray::BeginChromosome(){
+  m_coverage.Release();
+  ReleaseLanes();
+  m_run_indexes.clear();
+  m_read_positions.Clear();
+  m_max_coverage=0;
+  AllocateCoverage(GenomeSize()+1,~static_cast<int64_t>(0));
+}
+
+void CCoverageArray::EndChromosome(){
+  FinishReading();
+  std::map<int32_t,CGeneralFeatureVector>::iterator it = m_variants_by_chr.find(MyChr());
+  if(it!=m_variants_by_chr.end() && !it->second.empty()){
+    RefineRegion(*m_genome_stream,m_genome_refine_type,it->second);
+    it->second.clear();
+  }
+  m_coverage.Release();
+  m_run_indexes.clear();
+  m_read_positions.Clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Several alignment files
+// Each input is decoded on a thread by its own CSAMReader, which counts
+// coverage on a lane of its own. Lanes are summed into m_coverage at the end.
+// Lanes are per thread, or per input when they are kept for --sample-lanes.
+// Read starts are sorted only within an input, so each input has its own
+// CReadPositions even when a thread reads several inputs into one lane.
+class CCoverageLoader : public CSAMReader {
+ private:
+  coverage_counter_t* m_lane;
+  CReadPositions* m_read_positions;
+  void Treat(const CSAMAlignment& aln, const char *text){
+    m_read_positions->AddRead(aln.Start());
+    for(int64_t i=aln.Start();i<=aln.End();++i) m_lane->Increment(i);
+  }
+ public:
+  CChromosomeNormalizer Normalizer;
+  CCoverageLoader(int32_t chr, int64_t size, const CChromosomeNormalizer& cn){
+    SetUp(chr);
+    m_read_positions = 0;
+    m_lane = new coverage_counter_t;
+    m_lane->Allocate(size,~static_cast<int64_t>(0));
+    Normalizer = cn;
+    Normalizer.ClearUnknown(); // Merged back after reading
+  }
+  ~CCoverageLoader(){delete m_lane;}
+  void Read(const char *sam_file, CReadPositions* read_positions){
+    m_read_positions = read_positions;
+    ReadSAM(sam_file,Normalizer);
+  }
+  inline const coverage_counter_t& Lane() const {return *m_lane;}
+  inline coverage_counter_t* ReleaseLane(){coverage_counter_t* lane=m_lane; m_lane=0; return lane;}
+  inline int64_t MinPosition() const {return CSAMReader::MinPosition();}
+  inline int64_t MaxPosition() const {return CSAMReader::MaxPosition();}
+};
+
+struct parallel_load_t {
+  const std::vector<const char*>* Files;
+  std::vector<CCoverageLoader*> Loaders;
+  std::vector<CReadPositions> ReadPositions;  // per input
+  bool KeepLanes;
+  volatile uint32_t Next;
+};
+
+static void LoadWorker(void* arg, int32_t thread_id){
+  parallel_load_t* pl = static_cast<parallel_load_t*>(arg);
+  for(;;){
+    uint32_t i = __sync_fetch_and_add(&pl->Next,1);
+    if(i>=pl->Files->size()) break;
+    CCoverageLoader* loader = pl->Loaders[pl->KeepLanes? i: thread_id];
+    loader->Read((*pl->Files)[i],&pl->ReadPositions[i]);
+  }
+}
+
+void CCoverageArray::ReadInParallel(const std::vector<const char*>& sam_files, CChromosomeNormalizer& normalizer, bool keep_lanes){
+  int32_t n_threads = std::min<int32_t>(m_n_threads,sam_files.size());
+  int32_t n_lanes = keep_lanes? sam_files.size(): n_threads;
+  int64_t size = GenomeSize()+1;
+  if(Option().Find("verbose")) std::cerr<<"# reading "<<sam_files.size()<<" alignment files on "<<n_threads<<" threads, "<<n_lanes<<" coverage lanes"<<std::endl;
+  { CCigarString cigar; } // Read static configuration before threads do
+
+  parallel_load_t pl;
+  pl.Files=&sam_files;
+  pl.KeepLanes=keep_lanes;
+  pl.Next=0;
+  pl.ReadPositions.resize(sam_files.size());
+  for(int32_t k=0;k<n_lanes;++k) pl.Loaders.push_back(new CCoverageLoader(MyChr(),size,normalizer));
+  try{
+    CThreadGroup threads;
+    threads.Run(n_threads,LoadWorker,&pl);
+  }catch(CError& e){
+    for(int32_t k=0;k<n_lanes;++k) delete pl.Loaders[k];
+    throw;
   }
+
+  if(m_coverage.Empty()) AllocateCoverage(size,~static_cast<int64_t>(0));
+  for(int32_t k=0;k<n_lanes;++k){
+    CCoverageLoader* loader = pl.Loaders[k];
+    m_coverage.Add(loader->Lane());
+    if(loader->MinPosition()>=0) UpdateMinPosition(loader->MinPosition());
+    UpdateMaxPosition(loader->MaxPosition());
+    normalizer.MergeUnknown(loader->Normalizer);
+    if(keep_lanes) m_lanes.push_back(loader->ReleaseLane());
+    delete loader;
+  }
+  for(uint32_t i=0;i<pl.ReadPositions.size();++i) m_read_positions.Merge(pl.ReadPositions[i]);
+  m_max_coverage = m_coverage.Max();
+}
+
+void CCoverageArray::ReleaseLanes(){
+  for(uint32_t k=0;k<m_lanes.size();++k) delete m_lanes[k];
+  m_lanes.clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Coverage cache: narrow counters are used in place from the mapped file.
+
+bool CCoverageArray::LoadCache(){
+  const char *p = m_cache.Map(coverage_counter_t::BLOCK_SIZE);
+  if(!p) return false;
+  const CCoverageCache::header_t& header = *reinterpret_cast<const CCoverageCache::header_t*>(p);
+  if(header.CounterSize<GenomeSize()+1 || (header.CounterSize & (coverage_counter_t::BLOCK_SIZE-1))!=0){
+    Warning("Ignoring coverage cache of size "<<header.CounterSize<<": "<<m_cache.Path());
+    m_cache.Unmap();
+    return false;
+  }
+  // Indexes of widened blocks, before anything is attached
+  const char *wide = p + CCoverageCache::PAGE_SIZE + header.CounterSize*sizeof(coverage_counter_t::narrow_type);
+  for(int64_t i=0;i<header.NWideBlocks;++i){
+    int64_t block = *reinterpret_cast<const int64_t*>(wide+i*(sizeof(int64_t)+coverage_counter_t::BLOCK_SIZE*sizeof(uint32_t)));
+    if(block<0 || block>=header.CounterSize/coverage_counter_t::BLOCK_SIZE){
+      Warning("Ignoring coverage cache with invalid block "<<block<<": "<<m_cache.Path());
+      m_cache.Unmap();
+      return false;
+    }
+  }
+  p += CCoverageCache::PAGE_SIZE;
+  m_coverage.Attach(reinterpret_cast<const coverage_counter_t::narrow_type*>(p),header.CounterSize,~static_cast<int64_t>(0));
+  p += header.CounterSize*sizeof(coverage_counter_t::narrow_type);
+  for(int64_t i=0;i<header.NWideBlocks;++i){
+    const int64_t *block = reinterpret_cast<const int64_t*>(p);
+    p += sizeof(int64_t);
+    m_coverage.SetWideBlock(*block,reinterpret_cast<const uint32_t*>(p));
+    p += coverage_counter_t::BLOCK_SIZE*sizeof(uint32_t);
+  }
+  m_read_positions.Load(p,header.NReads,header.NReadBuckets);
+  if(header.MinPosition>=0) UpdateMinPosition(header.MinPosition);
+  UpdateMaxPosition(header.MaxPosition);
+  m_max_coverage = header.MaxCoverage;
+  return true;
+}
+
+void CCoverageArray::SaveCache(){
+  CCoverageCache::header_t header;
+  header.CounterWidth = 8*sizeof(coverage_counter_t::narrow_type);
+  header.CounterSize = m_coverage.Size();
+  header.MinPosition = MinPosition();
+  header.MaxPosition = MaxPosition();
+  header.MaxCoverage = m_max_coverage;
+  header.NWideBlocks = m_coverage.NWideBlocks();
+  header.NReads = m_read_positions.NReads();
+  header.NReadBuckets = m_read_positions.NBuckets();
+
+  const char *tmp = m_cache.TemporaryPath();
+  std::ofstream file(tmp,std::ios::binary);
+  if(!file){
+    Warning("Cannot write coverage cache "<<tmp);
+    return;
+  }
+  m_cache.WriteHeader(file,header);
+  file.write(reinterpret_cast<const char*>(m_coverage.Narrow()),m_coverage.Size()*sizeof(coverage_counter_t::narrow_type));
+  for(int64_t b=0;b<m_coverage.NBlocks();++b){
+    const uint32_t *w = m_coverage.WideBlock(b);
+    if(!w) continue;
+    file.write(reinterpret_cast<const char*>(&b),sizeof(b));
+    file.write(reinterpret_cast<const char*>(w),coverage_counter_t::BLOCK_SIZE*sizeof(uint32_t));
+  }
+  m_read_positions.Save(file);
+  file.close();
+  if(!file){
+    Warning("Failed to write coverage cache "<<tmp);
+    m_cache.Abandon();
+    return;
+  }
+  m_cache.Commit();
 }
 
 void CCoverageArray::Treat(const CSAMAlignment& aln, const char *text){
-  m_read_positions.AddRead(aln.Start(),aln.End());
+  if(m_is_streaming){
+    if(aln.End()-aln.Start()+1>m_max_read_length) Quit("Alignment longer than max-read-length("<<m_max_read_length<<"): "<<text);
+    AdvanceStream(aln.Start());
+    if(aln.End()>m_ring_base+m_coverage.Mask()) Quit("Coverage ring overflow at "<<aln.End()<<": base="<<m_ring_base<<", size="<<m_coverage.Size());
+  }else{
+    m_read_positions.AddRead(aln.Start());
+  }
   for(int64_t i=aln.Start();i<=aln.End();++i){
-    if(m_coverage[i]==std::numeric_limits<uint16_t>::max()) Quit("Coverage overflow: i="<<i<<": "<<text);
-    m_coverage[i]++;
-    if(m_max_coverage<m_coverage[i]) m_max_coverage=m_coverage[i];
+    int64_t c = m_coverage.Increment(i);
+    if(m_max_coverage<c) m_max_coverage=c;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Streaming refinement
+//
+// Alignments arrive sorted by position, so coverage at positions before the
+// start of the current alignment can no longer change. A variant is refined
+// as soon as the reader passes its end plus the padding used by margins and
+// coverage windows, and the bases nobody needs any more are recycled.
+
+void CCoverageArray::RefineWhileReading(std::ostream &stream, refine_type_t rt, CGeneralFeatureVector& variants, const char *sam_file, CChromosomeNormalizer& normalizer){
+  if(variants.empty()) Quit("Empty variation sets");
+  std::sort(variants.begin(),variants.end());
+
+  m_stream_padding = MarginSize();
+  if(m_stream_padding<s_window_size) m_stream_padding=s_window_size;
+  m_stream_padding += 1;
+
+  // Lowest position still needed by variant i or any variant after it
+  m_stream_lower_bound.assign(variants.size()+1,std::numeric_limits<int64_t>::max());
+  int64_t widest=0;
+  for(int64_t i=variants.size()-1;i>=0;--i){
+    int64_t lower = variants[i].Start()-m_stream_padding;
+    if(lower<0) lower=0;
+    m_stream_lower_bound[i] = std::min(lower,m_stream_lower_bound[i+1]);
+    int64_t width = variants[i].End()+m_stream_padding-m_stream_lower_bound[i]+1;
+    if(widest<width) widest=width;
+  }
+  int64_t ring_size=coverage_counter_t::BLOCK_SIZE;
+  while(ring_size<widest+m_max_read_length) ring_size<<=1;
+  if(Option().Find("verbose")){
+    std::cerr<<"# streaming refinement: ring size="<<ring_size<<", padding="<<m_stream_padding<<std::endl;
+  }
+
+  AllocateCoverage(ring_size,ring_size-1);
+  if(Option().Find("verbose")) std::cerr<<"# coverage ring backing="<<m_coverage.Backing()<<std::endl;
+  m_is_streaming=true;
+  m_stream_variants=&variants;
+  m_next_variant=0;
+  m_stream=&stream;
+  m_stream_refine_type=rt;
+
+  CSAMReader::ReadSAM(sam_file,normalizer);
+  AdvanceStream(std::numeric_limits<int64_t>::max());
+  m_is_streaming=false;
+  m_stream_variants=0;
+  m_stream=0;
+}
+
+void CCoverageArray::AdvanceStream(int64_t position){
+  const CGeneralFeatureVector& variants = *m_stream_variants;
+  for(;;++m_next_variant){
+    // Recycle bases below what remaining variants and the current alignment need.
+    // This is done before every variant, since the ring is only sized for the
+    // span of one variant and the variants after it.
+    int64_t keep = std::min(position,m_stream_lower_bound[m_next_variant]);
+    if(keep>m_ring_base){
+      m_coverage.Clear(m_ring_base,keep);
+      m_ring_base=keep;
+    }
+    // Refine variants whose coverage is final
+    if(m_next_variant>=variants.size()) break;
+    const CGeneralFeature& var = variants[m_next_variant];
+    if(var.End()+m_stream_padding>=position) break;
+    AnalyzeRegion(*m_stream,SerialContext(),m_next_variant,var.Start(),var.End(),m_stream_refine_type);
   }
 }
 
@@ -354,42 +1096,42 @@ void CCoverageArray::Show(std::ostream &stream, int32_t indent) const {
   stream<<"{\"chr\":"<<MyChr()<<", \"genome_size\":"<<GenomeSize()<<", ["<<std::endl;
   for(int64_t i=0;i<=GenomeSize()+1;++i){ // !!! array index
     if(i>0) stream<<","<<std::endl;
-    stream<<" ["<<i<<", "<<m_coverage[i]<<"]";
+    stream<<" ["<<i<<", "<<Coverage(i)<<"]";
   }
   stream<<'}'<<std::endl;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
+// Bins of bin_size bases from MinPosition() while they start before MaxPosition()-bin_size
+void CCoverageArray::BinHistogram(int64_t bin_size, int32_t coverage_unit, CCoverageHistogram::bins_t* bins) const{
+  if(bin_size<=0) Quit("Invalid bin size: "<<bin_size);
+  int64_t from = MinPosition();
+  if(from<0) from=0; // No read
+  int64_t n_bins = std::max<int64_t>(0,(MaxPosition()-bin_size-from+bin_size-1)/bin_size);
+  CCoverageHistogram::Bins(m_coverage,from,n_bins,bin_size,coverage_unit,bin_size*1024/coverage_unit,m_n_threads,bins);
+}
+
 void CCoverageArray::StatisticalAnalysis(int32_t coverage_unit) const {
   int64_t binsize = Option().RequireInteger("bin-size");
   std::cerr<<"# binsize="<<binsize<<std::endl;
   std::cerr<<"# range=["<<MinPosition()<<','<<MaxPosition()-binsize<<"]"<<std::endl;
   int32_t n_bins = (MaxPosition()-binsize-MinPosition())/binsize;
   std::cerr<<"# total "<<n_bins<<" bins."<<std::endl;
-  int32_t max_frequency = binsize*1024/coverage_unit;
-  int32_t frequency[max_frequency];
-  int64_t total_n_bases = 0;
-  for(int32_t i=0;i<max_frequency;++i) frequency[i]=0;
-  for(int64_t window=MinPosition();window<MaxPosition()-binsize;window+=binsize){
-    int64_t b=0;
-    for(int64_t i=window;i<window+binsize;++i) b += m_coverage[i];
-    total_n_bases += b;
-    if(b/coverage_unit>=max_frequency){
-      std::cerr<<"Warning: Too much frequency: window="<<window<<", nbases="<<b<<std::endl;
-      continue;
-    }
-    ++frequency[b/coverage_unit];
+  CCoverageHistogram::bins_t bins;
+  BinHistogram(binsize,coverage_unit,&bins);
+  for(uint32_t k=0;k<bins.Overflow.size();++k){
+    std::cerr<<"Warning: Too much frequency: window="<<bins.Overflow[k]<<", nbases="<<bins.OverflowSum[k]<<std::endl;
   }
 
-  std::cerr<<"# average coverage = "<<static_cast<double>(total_n_bases)/(MaxPosition()-MinPosition())<<std::endl;
+  std::cerr<<"# average coverage = "<<static_cast<double>(bins.Total)/(MaxPosition()-MinPosition())<<std::endl;
 
   double cumulative_n_bins=0;
-  for(int32_t i=0;i<max_frequency;++i){
-    if(frequency[i]==0) continue;
+  for(uint32_t i=0;i<bins.Frequency.size();++i){
+    if(bins.Frequency[i]==0) continue;
     std::cout<<i<<'\t'<<static_cast<double>(i)*coverage_unit/binsize<<'\t'
-             <<frequency[i]<<'\t'<<cumulative_n_bins<<'\t'<<cumulative_n_bins/n_bins
+             <<bins.Frequency[i]<<'\t'<<cumulative_n_bins<<'\t'<<cumulative_n_bins/n_bins
              <<std::endl;
-    cumulative_n_bins += frequency[i];
+    cumulative_n_bins += bins.Frequency[i];
   }
 }
 
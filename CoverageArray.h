@@ -12,11 +12,15 @@
 
 #include <stdint.h>
 #include <vector>
+#include <map>
 #include "Utility.h"
 #include "FileReader.h"
 #include "GeneralFeature.h"
 #include "CoverageDistribution.h"
+#include "CoverageCounter.h"
+#include "CoverageCache.h"
 #include "SAMReader.h"
+#include "Thread.h"
 
 //class CGeneralFeature;
 class CSAMAlignment;
@@ -52,67 +56,237 @@ public:
 };
 */
 
+/**
+ * @brief Sorted starting positions of reads, counted in a range in O(log n)
+ *
+ * A start p is split into its bucket p>>LOW_BITS and its low bits. Only the
+ * low bits are kept per read (one byte), in the order of the reads, and
+ * m_first[k] is the number of reads starting before bucket k. Reads starting
+ * before p are m_first[p>>LOW_BITS] plus a binary search among the low bits
+ * of that bucket. This takes a byte per read and 4 bytes per 256 bases.
+ */
 class CReadPositions {
 public:
-  class read_position_t {
-  private:
-    int32_t m_begin;
-    int32_t m_end;
-  public:
-    inline read_position_t(int32_t b, int32_t e){m_begin=b; m_end=e;}
-    bool operator<(const read_position_t& another);
-    inline int32_t Begin() const {return m_begin;}
-    inline int32_t End  () const {return m_end;}
-    inline void Write(std::ostream &s) const {s<<'['<<m_begin<<','<<m_end<<']';}
-  };
+  static const int32_t LOW_BITS=8;
+  static const int64_t BUCKET_SIZE=1<<LOW_BITS;
 private:
-  std::vector<read_position_t> m_read_positions;
+  std::vector<uint8_t> m_low;
+  std::vector<uint32_t> m_first;
+  int64_t m_last;
   //protected:
   int32_t m_bin_size;
   //protected:
+  int64_t Rank(int64_t p) const;
 public:
   CReadPositions();
   bool TTest(int64_t begin_pos, int64_t end_pos, double mu, int32_t binsize) const;
-  int64_t NAlignmentsIn(int64_t begin_pos, int64_t end_pos, int64_t *index) const;
-  inline void AddRead(int64_t b,int64_t e){m_read_positions.push_back(read_position_t(b,e));}
-  inline int64_t NReads() const {return m_read_positions.size();}
+  /// Reads starting in [begin_pos,end_pos]
+  inline int64_t NAlignmentsIn(int64_t begin_pos, int64_t end_pos) const {return begin_pos>end_pos? 0: Rank(end_pos+1)-Rank(begin_pos);}
+  /// Starts of one sorted input only; combine the reads of several inputs by Merge()
+  inline void AddRead(int64_t begin){
+    if(begin<m_last) Quit("Reads are not sorted by position: "<<m_last<<">"<<begin);
+    m_last=begin;
+    for(int64_t k=begin>>LOW_BITS;sign_cast<int64_t>(m_first.size())<=k;) m_first.push_back(m_low.size());
+    m_low.push_back(begin&(BUCKET_SIZE-1));
+  }
+  inline int64_t NReads() const {return m_low.size();}
+  inline int64_t NBuckets() const {return m_first.size();}
+  inline int64_t MemoryUsage() const {return m_low.size()*sizeof(uint8_t)+m_first.size()*sizeof(uint32_t);}
+  inline void Clear(){m_low.clear(); m_first.clear(); m_last=0;}
+  void Save(std::ostream &stream) const;
+  const char *Load(const char *p, int64_t n_reads, int64_t n_buckets);
+  void Merge(const CReadPositions& another);
+};
+
+// Width of per-base counters; bases beyond its limit are widened block by block.
+#ifndef COVERAGE_COUNTER_WIDTH
+#define COVERAGE_COUNTER_WIDTH 8
+#endif
+#if COVERAGE_COUNTER_WIDTH==16
+typedef CCoverageCounter<uint16_t> coverage_counter_t;
+#else
+typedef CCoverageCounter<uint8_t>  coverage_counter_t;
+#endif
+
+/**
+ * @brief Alternating runs of bases below and at-or-above one coverage threshold
+ *
+ * Run k covers [m_boundary[k],m_boundary[k+1]). The coverage summed before
+ * every boundary gives the coverage of whole runs in O(1); partial runs at
+ * the ends of a range are summed from the counters.
+ */
+class CCoverageRunIndex {
+private:
+  const coverage_counter_t* m_coverage;
+  std::vector<int64_t> m_boundary;   // Start of each run, followed by the end of the last one
+  std::vector<int64_t> m_cumulative; // Coverage summed before each boundary
+  bool m_first_above;
+  int64_t Run(int64_t p) const;
+  inline bool Above(int64_t run) const {return ((run&1)==0)==m_first_above;}
+  int64_t Prefix(int64_t p) const;
+public:
+  CCoverageRunIndex(){m_coverage=0; m_first_above=false;}
+  void Build(const coverage_counter_t& coverage, uint32_t threshold);
+  inline int64_t NRuns() const {return m_boundary.empty()? 0: m_boundary.size()-1;}
+  int64_t FindCrossing(int64_t from, int64_t to, int32_t direction, bool above) const;
+  int64_t SumBetween(int64_t from, int64_t to, int32_t direction) const;
+};
+
+/**
+ * @brief Coverage distributions of a chromosome computed on several threads
+ *
+ * The range is split into one chunk per thread, aligned to counter blocks or
+ * to bins. Each thread fills a private histogram, and the histograms are
+ * merged at the end. Bins are summed with the vectorized CCoverageCounter::Sum().
+ */
+class CCoverageHistogram {
+public:
+  /// Distribution of window sums of a fixed number of bases
+  struct bins_t {
+    std::vector<int64_t> Frequency;  ///< Number of bins by (sum of coverage)/unit
+    std::vector<int64_t> Overflow;   ///< Start of bins beyond Frequency, in order
+    std::vector<uint64_t> OverflowSum;
+    uint64_t Total;                  ///< Coverage summed over all bins
+    int64_t NBins;
+  };
+private:
+  struct job_t;
+  static void BasesWorker(void* arg, int32_t thread_id);
+  static void BinsWorker(void* arg, int32_t thread_id);
+public:
+  static void Bases(const coverage_counter_t& coverage, int64_t from, int64_t to, uint32_t limit, int32_t n_threads, std::vector<int64_t>* histogram);
+  static void Bins(const coverage_counter_t& coverage, int64_t from, int64_t n_bins, int64_t bin_size, int64_t unit, int64_t n_indexes, int32_t n_threads, bins_t* bins);
+};
+
+/**
+ * @brief Prefix sums of coverage over a short region, giving window means of any width
+ *
+ * Built once for the region next to an edge under refinement, and used for
+ * every fragment found from that edge, each of which asks for another width.
+ */
+class CCoverageWindowSums {
+private:
+  std::vector<uint64_t> m_prefix; // m_prefix[i]: coverage summed over [m_from,m_from+i)
+  int64_t m_from;
+public:
+  CCoverageWindowSums(){m_from=0;}
+  void Build(const coverage_counter_t& coverage, int64_t from, int64_t to);
+  inline int64_t From() const {return m_from;}
+  inline int64_t Length() const {return m_prefix.empty()? 0: m_prefix.size()-1;}
+  inline bool Covers(int64_t from, int64_t to) const {return m_from<=from && to<=m_from+Length();}
+  void Means(int64_t from, int64_t to, int64_t width, std::vector<int32_t>* means) const;
 };
-inline std::ostream& operator<<(std::ostream &s, const CReadPositions::read_position_t& rp){rp.Write(s); return s;}
 
 class CCoverageArray : private CSAMReader {
   //class CCoverageArray {
 public:
   typedef enum {REFINE_COVERAGE, REFINE_EDGE, REFINE_FRAGMENTED_EDGE} refine_type_t;
+  /// Thresholds used by one refinement; several sets are evaluated in a parameter sweep.
+  struct refine_parameter_t {
+    int32_t CoverageThreshold;    ///< -k
+    double FragmentThresholdRate; ///< -f
+    int32_t MaxChopLength;        ///< -x
+    double MarginParameter;       ///< -a
+    std::string Tag;              ///< Empty unless sweeping
+  };
+  /// Destinations of one refinement; per-variant buffers when refining on several threads.
+  struct refine_context_t {
+    std::ostream* Window;           ///< "C" lines of coverage distributions
+    std::ostream* Log;              ///< Messages otherwise written to std::cerr
+    CCoverageDistribution* CovDist; ///< Scratch distribution
+  };
 private:
   CReadPositions m_read_positions;
 
   int32_t m_max_coverage;
   double m_average_density;
-  double m_fragment_threshold_rate;
-  double m_margin_parameter;
   double m_refinement_coverage_threshold;
-  uint16_t* m_coverage;
+  coverage_counter_t m_coverage;
+  CCoverageCache m_cache;
+  std::vector<coverage_counter_t*> m_lanes; // Coverage of each input with --sample-lanes
   static int32_t s_window_size;
-  int32_t m_coverage_threshold;
   //int32_t m_ margin_size;
-  int32_t m_max_chop_length;
+  std::vector<refine_parameter_t> m_parameter_sets;
   const char *m_output_format;
 
-  void RefineByCoverage(std::vector<int64_t> *regions, int64_t front_pos, int64_t back_pos) const;
-  int64_t RefineOneSide(int64_t front_pos, int64_t back_pos, refine_type_t rt) const;
-  void RefineEdge(std::vector<int64_t> *regions, int64_t front_pos, int64_t back_pos, refine_type_t rt) const;
-  void AnalyzeRegion(std::ostream &stream, int32_t no, int64_t front_pos, int64_t back_pos, refine_type_t rt) const;
+  // Streaming refinement: m_coverage is a ring buffer holding [m_ring_base, m_ring_base+m_coverage.Mask()]
+  bool m_is_streaming;
+  int64_t m_ring_base;
+  int64_t m_max_read_length;
+  int64_t m_stream_padding;
+  uint32_t m_next_variant;
+  std::vector<int64_t> m_stream_lower_bound;
+  const CGeneralFeatureVector* m_stream_variants;
+  std::ostream* m_stream;
+  refine_type_t m_stream_refine_type;
+
+  inline int64_t Coverage(int64_t i) const {return m_coverage.Get(i);}
+  static uint32_t CrossingThreshold(double threshold);
+  /// First position from 'from' toward 'to' (exclusive) whose coverage is (>=threshold)==above, or 'to'
+  /// Use the run index of the threshold if given (see RunIndex())
+  inline int64_t FindCrossing(const CCoverageRunIndex* runs, int64_t from, int64_t to, int32_t direction, uint32_t threshold, bool above) const {
+    if(runs) return runs->FindCrossing(from,to,direction,above);
+    return direction>0? m_coverage.FindForward(from,to,threshold,above): m_coverage.FindReverse(from,to,threshold,above);
+  }
+  /// Sum of coverage from 'from' toward 'to' (exclusive)
+  inline int64_t SumBetween(const CCoverageRunIndex* runs, int64_t from, int64_t to, int32_t direction) const {
+    if(runs) return runs->SumBetween(from,to,direction);
+    return direction>0? m_coverage.Sum(from,to): m_coverage.Sum(to+1,from+1);
+  }
+  /// Fewer calls than this are refined by local scans unless several parameter sets share the run index
+  static const uint32_t RUN_INDEX_MIN_CALLS=256;
+  mutable std::map<uint32_t,CCoverageRunIndex> m_run_indexes;
+  mutable CMutex m_run_index_mutex;
+  bool m_use_run_index;
+  const CCoverageRunIndex* RunIndex(uint32_t threshold) const;
+  void AllocateCoverage(int64_t size, int64_t mask);
+  void ReadInParallel(const std::vector<const char*>& sam_files, CChromosomeNormalizer& cn, bool keep_lanes);
+  void ReleaseLanes();
+  void FinishReading();
+  // Whole genome in one pass
+  std::map<int32_t,CGeneralFeatureVector> m_variants_by_chr;
+  std::ostream* m_genome_stream;
+  refine_type_t m_genome_refine_type;
+  void BeginChromosome();
+  void EndChromosome();
+  bool LoadCache();
+  void SaveCache();
+  void AdvanceStream(int64_t position);
+
+  void SetUpParameterSets();
+  void RefineByCoverage(std::vector<int64_t> *regions, int64_t front_pos, int64_t back_pos, const refine_parameter_t& param) const;
+  int64_t RefineOneSide(const refine_context_t& ctx, int64_t front_pos, int64_t back_pos, refine_type_t rt, const refine_parameter_t& param) const;
+  void RefineEdge(const refine_context_t& ctx, std::vector<int64_t> *regions, int64_t front_pos, int64_t back_pos, refine_type_t rt, const refine_parameter_t& param) const;
+  void AnalyzeRegion(std::ostream &stream, const refine_context_t& ctx, int32_t no, int64_t front_pos, int64_t back_pos, refine_type_t rt) const;
   //int64_t MinPosition() const;
   double CoverageIn(int64_t front_pos, int64_t back_pos) const;
-  mutable CCoverageDistribution m_covdist;
-  bool CoverageDistribution(int64_t front_pos, int64_t back_pos, int64_t w, CCoverageDistribution *covdist, double my_coverage) const;
+  CCoverageDistribution m_covdist;
+  std::ostream* m_window_stream; // "C" lines
+  std::ostream* m_log_stream;
+  int32_t m_n_threads;
+  refine_context_t SerialContext();
+  bool m_window_binary; // "C" records are written in binary
+  bool CoverageDistribution(const refine_context_t& ctx, int64_t front_pos, int64_t back_pos, int64_t w, double my_coverage, const CCoverageWindowSums& sums) const;
+  struct parallel_refinement_t;
+  static void RefineWorker(void* arg, int32_t thread_id);
+  void RefineRegionInParallel(std::ostream &stream, refine_type_t rt, const CGeneralFeatureVector& variants, int32_t n_threads);
   virtual void Treat(const CSAMAlignment& aln, const char *text);
 public:
   CCoverageArray();
+  ~CCoverageArray(){ReleaseLanes();}
   void SetUp(int32_t chrNo);
   void ReadSAM(const char *sam_file, CChromosomeNormalizer& cn);
+  void ReadSAM(const std::vector<const char*>& sam_files, CChromosomeNormalizer& cn);
+  void RefineWhileReading(std::ostream &stream, refine_type_t rt, CGeneralFeatureVector& variants, const char *sam_file, CChromosomeNormalizer& cn);
+  void RefineAllChromosomes(std::ostream &stream, refine_type_t rt, const CGeneralFeatureVector& variants, const char *sam_file, CChromosomeNormalizer& cn);
   void Show(std::ostream &stream, int32_t indent=0) const;
   void RefineRegion(std::ostream &stream, refine_type_t rt, CGeneralFeatureVector& variants);
+  /// Streams other than std::cout and std::cerr for coverage windows and logs of refinement
+  void SetSideStreams(std::ostream& window, std::ostream& log){m_window_stream=&window; m_log_stream=&log;}
+  /// Threads for refinement and reading, instead of --threads
+  void SetNThreads(int32_t n){m_n_threads=n;}
+  void BaseHistogram(uint32_t limit, std::vector<int64_t>* histogram) const;
+  void BinHistogram(int64_t bin_size, int32_t coverage_unit, CCoverageHistogram::bins_t* bins) const;
   void ShowCoverageDistribution(std::ostream &stream);
   void StatisticalAnalysis(int32_t coverage_unit) const;
 };
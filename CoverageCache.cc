@@ -0,0 +1,165 @@
+/**
+ * @file    CoverageCache.cc
+ * @brief   On-disk cache of coverage arrays shared by repeated runs
+ */
+
+#include <iostream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Option.h"
+#include "Utility.h"
+#include "CoverageCache.h"
+
+#ifdef BITVECTOR_LIB_BEGIN
+using namespace BitVectorLib;
+#endif
+
+static const char *s_cache_magic = "CSCOV002";
+
+////////////////////////////////////////////////////////////////////////////////
+// Returns false for standard input and pipes, which cannot be identified.
+bool CCoverageCache::AddFileIdentity(std::string* key, const char *filename){
+  Assert(key);
+  if(!filename || !*filename) return false;
+  if(filename[0]=='-' && !filename[1]) return false;
+  int32_t len=std::strlen(filename);
+  if(filename[len-1]=='|') return false;
+
+  char resolved[PATH_MAX];
+  if(! realpath(filename,resolved)) return false;
+  struct stat st;
+  if(stat(resolved,&st)!=0) return false;
+  std::ostringstream oss;
+  oss<<resolved<<':'<<st.st_size<<':'<<st.st_mtime<<':'<<st.st_ino<<'|';
+  *key += oss.str();
+  return true;
+}
+
+bool CCoverageCache::SetUp(const std::vector<const char*>& sam_files, const char *accession_file, int32_t chr, int64_t genome_size, int32_t counter_width){
+  Unmap();
+  m_key.erase();
+  m_path.erase();
+  const char *dir = Option().Find("coverage-cache");
+  if(!dir || !*dir) return false;
+
+  m_key = s_cache_magic;
+  m_key += '|';
+  foreach_const(std::vector<const char*>, sam_file, sam_files){
+    if(! AddFileIdentity(&m_key,*sam_file)){
+      Warning("Coverage cache is not available for "<<*sam_file);
+      m_key.erase();
+      return false;
+    }
+  }
+  if(accession_file) AddFileIdentity(&m_key,accession_file);
+  std::ostringstream oss;
+  oss<<"chr="<<chr<<"|genome-size="<<genome_size<<"|width="<<counter_width;
+  m_key += oss.str();
+  if(sign_cast<int64_t>(sizeof(header_t)+m_key.length())>=PAGE_SIZE) Quit("Too long key for coverage cache: "<<m_key);
+
+  // FNV-1a
+  uint64_t h=14695981039346656037ULL;
+  for(uint32_t i=0;i<m_key.length();++i){
+    h ^= static_cast<unsigned char>(m_key[i]);
+    h *= 1099511628211ULL;
+  }
+  char name[64];
+  m_key_hash=h;
+  std::sprintf(name,"/chopsticks-%016llx.cov",static_cast<unsigned long long>(h));
+  m_path = dir;
+  m_path += name;
+  if(Option().Find("verbose")) std::cerr<<"# coverage cache="<<m_path<<std::endl;
+  return true;
+}
+
+// Map the cache file, returning 0 if it does not exist, belongs to another key
+// or is truncated. A widened block is its index and wide_block_size counters.
+const char *CCoverageCache::Map(int64_t wide_block_size){
+  Unmap();
+  if(!Enabled()) return 0;
+  int fd = open(Path(),O_RDONLY);
+  if(fd<0) return 0;
+  struct stat st;
+  if(fstat(fd,&st)!=0 || st.st_size<PAGE_SIZE){ close(fd); return 0; }
+  void *p = mmap(0,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+  close(fd);
+  if(p==MAP_FAILED){
+    Warning("Cannot map coverage cache "<<Path());
+    return 0;
+  }
+  m_map = static_cast<char*>(p);
+  m_map_size = st.st_size;
+
+  const header_t *header = reinterpret_cast<const header_t*>(m_map);
+  if(std::memcmp(header->Magic,s_cache_magic,sizeof(header->Magic))!=0 ||
+     header->KeyHash!=m_key_hash ||
+     header->KeyLength!=sign_cast<int64_t>(m_key.length()) ||
+     std::memcmp(m_map+sizeof(header_t),m_key.c_str(),m_key.length())!=0){
+    Warning("Ignoring coverage cache for another input: "<<Path());
+    Unmap();
+    return 0;
+  }
+  // Each part is checked alone first, so that the sum cannot overflow
+  int64_t size = st.st_size;
+  int64_t wide_block_bytes = sizeof(int64_t)+wide_block_size*sizeof(uint32_t);
+  if(header->CounterWidth<8 || header->CounterWidth%8!=0 ||
+     header->CounterSize<0 || header->CounterSize>size ||
+     header->NWideBlocks<0 || header->NWideBlocks>size/wide_block_bytes ||
+     header->NReadBuckets<0 || header->NReadBuckets>size/static_cast<int64_t>(sizeof(uint32_t)) ||
+     header->NReads<0 || header->NReads>size ||
+     PAGE_SIZE+header->CounterSize*(header->CounterWidth/8)+header->NWideBlocks*wide_block_bytes
+       +header->NReadBuckets*static_cast<int64_t>(sizeof(uint32_t))+header->NReads>size){
+    Warning("Ignoring truncated coverage cache: "<<Path());
+    Unmap();
+    return 0;
+  }
+  return m_map;
+}
+
+void CCoverageCache::Unmap(){
+  if(!m_map) return;
+  munmap(m_map,m_map_size);
+  m_map=0;
+  m_map_size=0;
+}
+
+const char *CCoverageCache::TemporaryPath(){
+  std::ostringstream oss;
+  oss<<m_path<<'.'<<getpid()<<".tmp";
+  m_temporary_path = oss.str();
+  return m_temporary_path.c_str();
+}
+
+void CCoverageCache::Commit(){
+  if(std::rename(m_temporary_path.c_str(),Path())!=0) Quit("Cannot create coverage cache "<<Path());
+  if(Option().Find("verbose")) std::cerr<<"# coverage cache was written to "<<Path()<<std::endl;
+}
+
+void CCoverageCache::Abandon(){
+  if(!m_temporary_path.empty()) std::remove(m_temporary_path.c_str());
+}
+
+void CCoverageCache::WriteHeader(std::ostream& stream, const header_t& header) const {
+  header_t h=header;
+  std::memcpy(h.Magic,s_cache_magic,sizeof(h.Magic));
+  h.KeyHash=m_key_hash;
+  h.KeyLength=m_key.length();
+  stream.write(reinterpret_cast<const char*>(&h),sizeof(h));
+  stream.write(m_key.c_str(),m_key.length());
+  Pad(stream,PAGE_SIZE);
+}
+
+void CCoverageCache::Pad(std::ostream& stream, int64_t alignment){
+  int64_t p = stream.tellp();
+  while(p % alignment){ stream.put(0); ++p; }
+}
@@ -0,0 +1,67 @@
+/**
+ * @file    CoverageCache.h
+ * @brief   On-disk cache of coverage arrays shared by repeated runs
+ */
+
+#ifndef _COVERAGE_CACHE_H_
+#define _COVERAGE_CACHE_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "Utility.h"
+
+/**
+ * @brief Locate, map and commit coverage cache files
+ *
+ * A cache file is identified by the input alignment files (path, size,
+ * modification time and inode), the accession table, the chromosome, the
+ * genome size and the counter width. Its name is derived from a hash of
+ * that key, and the key itself is kept in the file to detect collisions.
+ *
+ * Layout: the first page holds header_t followed by the key, the narrow
+ * counters start at the second page so they can be mapped in place, and
+ * widened blocks and the read start index follow.
+ */
+class CCoverageCache {
+ public:
+  static const int64_t PAGE_SIZE=4096;
+  struct header_t {
+    char Magic[8];
+    uint64_t KeyHash;
+    int64_t KeyLength;
+    int64_t CounterWidth;
+    int64_t CounterSize;
+    int64_t MinPosition;
+    int64_t MaxPosition;
+    int64_t MaxCoverage;
+    int64_t NWideBlocks;
+    int64_t NReads;
+    int64_t NReadBuckets;
+  };
+ private:
+  std::string m_key;
+  uint64_t m_key_hash;
+  std::string m_path;
+  std::string m_temporary_path;
+  char* m_map;
+  int64_t m_map_size;
+  static bool AddFileIdentity(std::string* key, const char *filename);
+ public:
+  CCoverageCache(){m_key_hash=0; m_map=0; m_map_size=0;}
+  ~CCoverageCache(){Unmap();}
+  bool SetUp(const std::vector<const char*>& sam_files, const char *accession_file, int32_t chr, int64_t genome_size, int32_t counter_width);
+  inline bool Enabled() const {return !m_path.empty();}
+  inline const std::string& Key() const {return m_key;}
+  inline const char *Path() const {return m_path.c_str();}
+  /// Cache files shorter than the layout in their header are ignored as well
+  const char *Map(int64_t wide_block_size);
+  void Unmap();
+  const char *TemporaryPath();
+  void Commit();
+  void Abandon();
+  void WriteHeader(std::ostream& stream, const header_t& header) const;
+  static void Pad(std::ostream& stream, int64_t alignment);
+};
+
+#endif // _COVERAGE_CACHE_H_
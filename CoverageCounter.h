@@ -0,0 +1,407 @@
+/**
+ * @file    CoverageCounter.h
+ * @brief   Per-base coverage counters that widen only where needed
+ */
+
+#ifndef _COVERAGE_COUNTER_H_
+#define _COVERAGE_COUNTER_H_
+
+#include <stdint.h>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cstring>
+#include "Utility.h"
+#include "CoverageScan.h"
+#include "LargeMemory.h"
+
+/**
+ * @brief Coverage counters stored in narrow_t, widened to 32 bits per block
+ *
+ * Every base is counted in a narrow_t (uint8_t or uint16_t). When a base in
+ * a block reaches the limit of narrow_t, the whole block is copied into a
+ * 32-bit side array and counted there from then on. Most of a genome stays
+ * narrow while amplicons and high-copy regions do not overflow.
+ *
+ * Positions are masked with the mask given to Allocate(), so the same store
+ * can be used as a whole-chromosome array or as a ring buffer.
+ */
+template<typename narrow_t>
+class CCoverageCounter {
+ public:
+  typedef narrow_t narrow_type;
+  static const int32_t BLOCK_BITS=12;
+  static const int64_t BLOCK_SIZE=1<<BLOCK_BITS;
+  static const int32_t SUMMARY1_BITS=8;
+  static const int64_t SUMMARY1_SIZE=1<<SUMMARY1_BITS;
+  static const int32_t SUMMARY2_BITS=16;
+  static const int64_t SUMMARY2_SIZE=1<<SUMMARY2_BITS;
+ private:
+  narrow_t* m_narrow;
+  CLargeMemory m_memory;
+  std::vector<uint32_t*> m_wide;
+  int64_t m_size;
+  int64_t m_mask;
+  int64_t m_n_wide;
+  bool m_is_external;
+  // Block summary: min and max of every SUMMARY1_SIZE and SUMMARY2_SIZE bases
+  std::vector<uint32_t> m_min1, m_max1;
+  std::vector<uint32_t> m_min2, m_max2;
+  void Initialize(){m_narrow=0; m_size=0; m_mask=0; m_n_wide=0; m_is_external=false; DropSummary();}
+  void Widen(int64_t block);
+  void ClearSegment(int64_t from, int64_t to);
+  int64_t ScanForward(int64_t from, int64_t to, uint32_t threshold, bool above) const;
+  int64_t ScanReverse(int64_t from, int64_t to, uint32_t threshold, bool above) const;
+  // Whether a summarized range with these min and max can hold a base on the wanted side
+  static inline bool MayCross(uint32_t min, uint32_t max, uint32_t threshold, bool above){return above? max>=threshold: min<threshold;}
+ public:
+  CCoverageCounter(){Initialize();}
+  ~CCoverageCounter(){Release();}
+  void Allocate(int64_t size, int64_t mask);
+  void Attach(const narrow_t* narrow, int64_t size, int64_t mask);
+  void Release();
+  inline bool Empty() const {return m_narrow==0;}
+  inline int64_t Size() const {return m_size;}
+  inline int64_t Mask() const {return m_mask;}
+  inline int64_t NWideBlocks() const {return m_n_wide;}
+  inline int64_t NBlocks() const {return m_wide.size();}
+  inline const narrow_t* Narrow() const {return m_narrow;}
+  inline const char *Backing() const {return m_is_external? "external": m_memory.BackingName();}
+  inline const uint32_t* WideBlock(int64_t block) const {return m_wide[block];}
+  void SetWideBlock(int64_t block, const uint32_t* w);
+  inline int64_t MemoryUsage() const {return m_size*sizeof(narrow_t)+m_n_wide*BLOCK_SIZE*sizeof(uint32_t);}
+  inline uint32_t Get(int64_t i) const {
+    i &= m_mask;
+    const uint32_t* w=m_wide[i>>BLOCK_BITS];
+    return w? w[i&(BLOCK_SIZE-1)]: m_narrow[i];
+  }
+  inline uint32_t Increment(int64_t i){
+    i &= m_mask;
+    uint32_t* w=m_wide[i>>BLOCK_BITS];
+    if(!w){
+      if(m_narrow[i]<std::numeric_limits<narrow_t>::max()) return ++m_narrow[i];
+      Widen(i>>BLOCK_BITS);
+      w=m_wide[i>>BLOCK_BITS];
+    }
+    uint32_t& c = w[i&(BLOCK_SIZE-1)];
+    if(c==std::numeric_limits<uint32_t>::max()) Quit("Coverage overflow at "<<i);
+    return ++c;
+  }
+  void Clear(int64_t from, int64_t to);
+  void Add(const CCoverageCounter& another);
+  uint32_t Max() const;
+  void BuildSummary();
+  inline void DropSummary(){m_min1.clear(); m_max1.clear(); m_min2.clear(); m_max2.clear();}
+  inline bool HasSummary() const {return !m_min1.empty();}
+  inline int64_t SummaryMemoryUsage() const {return (m_min1.size()+m_max1.size()+m_min2.size()+m_max2.size())*sizeof(uint32_t);}
+  int64_t FindForward(int64_t from, int64_t to, uint32_t threshold, bool above) const;
+  int64_t FindReverse(int64_t from, int64_t to, uint32_t threshold, bool above) const;
+  uint64_t Sum(int64_t from, int64_t to) const;
+  void CountValues(int64_t from, int64_t to, uint32_t limit, int64_t* histogram) const;
+};
+
+template<typename narrow_t>
+void CCoverageCounter<narrow_t>::Allocate(int64_t size, int64_t mask){
+  Release();
+  // Round up to whole blocks
+  size = (size+BLOCK_SIZE-1) & ~(BLOCK_SIZE-1);
+  m_narrow = static_cast<narrow_t*>(m_memory.Allocate(size*sizeof(narrow_t)));
+  m_wide.assign(size>>BLOCK_BITS,static_cast<uint32_t*>(0));
+  m_size=size;
+  m_mask=mask;
+}
+
+// Use read-only narrow counters owned by someone else (ex. a mapped cache file).
+template<typename narrow_t>
+void CCoverageCounter<narrow_t>::Attach(const narrow_t* narrow, int64_t size, int64_t mask){
+  Release();
+  if(size & (BLOCK_SIZE-1)) Quit("Size of attached counters must be a multiple of "<<BLOCK_SIZE<<": "<<size);
+  m_narrow = const_cast<narrow_t*>(narrow);
+  m_is_external=true;
+  m_wide.assign(size>>BLOCK_BITS,static_cast<uint32_t*>(0));
+  m_size=size;
+  m_mask=mask;
+}
+
+template<typename narrow_t>
+void CCoverageCounter<narrow_t>::Release(){
+  for(uint32_t b=0;b<m_wide.size();++b) delete [] m_wide[b];
+  m_wide.clear();
+  m_memory.Release();
+  Initialize();
+}
+
+template<typename narrow_t>
+void CCoverageCounter<narrow_t>::SetWideBlock(int64_t block, const uint32_t* w){
+  if(block<0 || block>=NBlocks()) Quit("Invalid block: "<<block);
+  if(!m_wide[block]){
+    m_wide[block] = new uint32_t[BLOCK_SIZE];
+    ++m_n_wide;
+  }
+  std::memcpy(m_wide[block],w,BLOCK_SIZE*sizeof(uint32_t));
+}
+
+template<typename narrow_t>
+void CCoverageCounter<narrow_t>::Widen(int64_t block){
+  Assert(!m_wide[block]);
+  uint32_t* w = new uint32_t[BLOCK_SIZE];
+  const narrow_t* n = m_narrow+(block<<BLOCK_BITS);
+  for(int64_t i=0;i<BLOCK_SIZE;++i) w[i]=n[i];
+  m_wide[block]=w;
+  ++m_n_wide;
+}
+
+// Clear positions [from,to) given as unmasked positions.
+template<typename narrow_t>
+void CCoverageCounter<narrow_t>::Clear(int64_t from, int64_t to){
+  if(from>=to) return;
+  DropSummary();
+  if(to-from>=m_size){
+    ClearSegment(0,m_size);
+    return;
+  }
+  int64_t b=from & m_mask;
+  int64_t e=b+(to-from);
+  if(e<=m_size){
+    ClearSegment(b,e);
+  }else{
+    ClearSegment(b,m_size);
+    ClearSegment(0,e-m_size);
+  }
+}
+
+// Clear array indices [from,to); narrow blocks are zeroed, wide blocks are dropped when fully covered.
+template<typename narrow_t>
+void CCoverageCounter<narrow_t>::ClearSegment(int64_t from, int64_t to){
+  std::memset(m_narrow+from,0,(to-from)*sizeof(narrow_t));
+  for(int64_t block=from>>BLOCK_BITS;(block<<BLOCK_BITS)<to;++block){
+    uint32_t* w=m_wide[block];
+    if(!w) continue;
+    int64_t b=std::max(from,block<<BLOCK_BITS);
+    int64_t e=std::min(to,(block+1)<<BLOCK_BITS);
+    if(e-b==BLOCK_SIZE){
+      delete [] w;
+      m_wide[block]=0;
+      --m_n_wide;
+    }else{
+      std::memset(w+(b&(BLOCK_SIZE-1)),0,(e-b)*sizeof(uint32_t));
+    }
+  }
+}
+
+// First position in [from,to) whose counter is (>=threshold)==above, or to.
+// Each block is scanned at once: narrow blocks by CCoverageScan, wide blocks as uint32_t.
+template<typename narrow_t>
+int64_t CCoverageCounter<narrow_t>::ScanForward(int64_t from, int64_t to, uint32_t threshold, bool above) const{
+  const bool beyond_narrow = threshold>std::numeric_limits<narrow_t>::max();
+  for(int64_t p=from;p<to;){
+    int64_t i=p & m_mask;
+    int64_t block=i>>BLOCK_BITS;
+    int64_t n=std::min(to-p,((block+1)<<BLOCK_BITS)-i);
+    int64_t k;
+    const uint32_t* w=m_wide[block];
+    if(w)                  k=CCoverageScan<uint32_t>::Forward(w+(i&(BLOCK_SIZE-1)),n,threshold,above);
+    else if(threshold==0)  k=above? 0: n;
+    else if(beyond_narrow) k=above? n: 0;
+    else                   k=CCoverageScan<narrow_t>::Forward(m_narrow+i,n,threshold,above);
+    if(k<n) return p+k;
+    p+=n;
+  }
+  return to;
+}
+
+// Last position in (to,from], searched from 'from' downward, whose counter is (>=threshold)==above, or to.
+template<typename narrow_t>
+int64_t CCoverageCounter<narrow_t>::ScanReverse(int64_t from, int64_t to, uint32_t threshold, bool above) const{
+  const bool beyond_narrow = threshold>std::numeric_limits<narrow_t>::max();
+  for(int64_t p=from;p>to;){
+    int64_t i=p & m_mask;
+    int64_t block=i>>BLOCK_BITS;
+    int64_t n=std::min(p-to,(i&(BLOCK_SIZE-1))+1);
+    int64_t b=i-n+1;
+    int64_t k;
+    const uint32_t* w=m_wide[block];
+    if(w)                  k=CCoverageScan<uint32_t>::Reverse(w+(b&(BLOCK_SIZE-1)),n,threshold,above);
+    else if(threshold==0)  k=above? n-1: -1;
+    else if(beyond_narrow) k=above? -1: n-1;
+    else                   k=CCoverageScan<narrow_t>::Reverse(m_narrow+b,n,threshold,above);
+    if(k>=0) return p-(n-1-k);
+    p-=n;
+  }
+  return to;
+}
+
+// Add counters of another whole-chromosome array, widening blocks that overflow.
+template<typename narrow_t>
+void CCoverageCounter<narrow_t>::Add(const CCoverageCounter& another){
+  if(m_mask!=~static_cast<int64_t>(0) || another.m_mask!=~static_cast<int64_t>(0)) Quit("Ring buffers cannot be added");
+  if(another.m_size>m_size) Quit("Adding counters of size "<<another.m_size<<" to "<<m_size);
+  DropSummary();
+  for(int64_t block=0;block<another.NBlocks();++block){
+    int64_t base=block<<BLOCK_BITS;
+    const uint32_t* aw=another.m_wide[block];
+    const narrow_t* an=another.m_narrow+base;
+    if(!m_wide[block]){
+      narrow_t* n=m_narrow+base;
+      bool overflow=(aw!=0);
+      for(int64_t i=0;i<BLOCK_SIZE && !overflow;++i){
+        overflow = static_cast<uint32_t>(n[i])+an[i] > std::numeric_limits<narrow_t>::max();
+      }
+      if(!overflow){
+        for(int64_t i=0;i<BLOCK_SIZE;++i) n[i]+=an[i];
+        continue;
+      }
+      Widen(block);
+    }
+    uint32_t* w=m_wide[block];
+    for(int64_t i=0;i<BLOCK_SIZE;++i){
+      uint64_t c=static_cast<uint64_t>(w[i])+(aw? aw[i]: an[i]);
+      if(c>std::numeric_limits<uint32_t>::max()) Quit("Coverage overflow at "<<base+i);
+      w[i]=c;
+    }
+  }
+}
+
+template<typename narrow_t>
+uint32_t CCoverageCounter<narrow_t>::Max() const{
+  uint32_t max=0;
+  if(HasSummary()){
+    for(uint32_t k=0;k<m_max2.size();++k) max=std::max(max,m_max2[k]);
+    return max;
+  }
+  for(int64_t block=0;block<NBlocks();++block){
+    const uint32_t* w=m_wide[block];
+    const narrow_t* n=m_narrow+(block<<BLOCK_BITS);
+    for(int64_t i=0;i<BLOCK_SIZE;++i) max=std::max<uint32_t>(max,w? w[i]: n[i]);
+  }
+  return max;
+}
+
+// Build the two-level min/max summary used by FindForward() and FindReverse().
+// It is meant for whole-chromosome arrays once all reads are counted;
+// Increment() does not update it, and Clear() drops it.
+template<typename narrow_t>
+void CCoverageCounter<narrow_t>::BuildSummary(){
+  if(m_mask!=~static_cast<int64_t>(0)) Quit("Block summary is not available for ring buffers");
+  int64_t n1=m_size>>SUMMARY1_BITS;
+  int64_t n2=(m_size+SUMMARY2_SIZE-1)>>SUMMARY2_BITS;
+  m_min1.assign(n1,0);
+  m_max1.assign(n1,0);
+  m_min2.assign(n2,std::numeric_limits<uint32_t>::max());
+  m_max2.assign(n2,0);
+  for(int64_t j=0;j<n1;++j){
+    int64_t b=j<<SUMMARY1_BITS;
+    const uint32_t* w=m_wide[b>>BLOCK_BITS];
+    uint32_t min=std::numeric_limits<uint32_t>::max(), max=0;
+    if(w){
+      w+=b&(BLOCK_SIZE-1);
+      for(int64_t i=0;i<SUMMARY1_SIZE;++i){ min=std::min(min,w[i]); max=std::max(max,w[i]); }
+    }else{
+      const narrow_t* n=m_narrow+b;
+      narrow_t nmin=std::numeric_limits<narrow_t>::max(), nmax=0;
+      for(int64_t i=0;i<SUMMARY1_SIZE;++i){ nmin=std::min(nmin,n[i]); nmax=std::max(nmax,n[i]); }
+      min=nmin;
+      max=nmax;
+    }
+    m_min1[j]=min;
+    m_max1[j]=max;
+    int64_t k=j>>(SUMMARY2_BITS-SUMMARY1_BITS);
+    m_min2[k]=std::min(m_min2[k],min);
+    m_max2[k]=std::max(m_max2[k],max);
+  }
+}
+
+// First position in [from,to) whose counter is (>=threshold)==above, or to.
+// With a summary, ranges whose min/max exclude a crossing are skipped.
+template<typename narrow_t>
+int64_t CCoverageCounter<narrow_t>::FindForward(int64_t from, int64_t to, uint32_t threshold, bool above) const{
+  if(!HasSummary()) return ScanForward(from,to,threshold,above);
+  for(int64_t p=from;p<to;){
+    int64_t k2=p>>SUMMARY2_BITS;
+    if(!MayCross(m_min2[k2],m_max2[k2],threshold,above)){
+      p=std::min(to,(k2+1)<<SUMMARY2_BITS);
+      continue;
+    }
+    int64_t k1=p>>SUMMARY1_BITS;
+    int64_t q=std::min(to,(k1+1)<<SUMMARY1_BITS);
+    if(MayCross(m_min1[k1],m_max1[k1],threshold,above)){
+      int64_t x=ScanForward(p,q,threshold,above);
+      if(x<q) return x;
+    }
+    p=q;
+  }
+  return to;
+}
+
+// Last position in (to,from], searched from 'from' downward, whose counter is (>=threshold)==above, or to.
+template<typename narrow_t>
+int64_t CCoverageCounter<narrow_t>::FindReverse(int64_t from, int64_t to, uint32_t threshold, bool above) const{
+  if(!HasSummary()) return ScanReverse(from,to,threshold,above);
+  for(int64_t p=from;p>to;){
+    int64_t k2=p>>SUMMARY2_BITS;
+    if(!MayCross(m_min2[k2],m_max2[k2],threshold,above)){
+      p=std::max(to,(k2<<SUMMARY2_BITS)-1);
+      continue;
+    }
+    int64_t k1=p>>SUMMARY1_BITS;
+    int64_t q=std::max(to,(k1<<SUMMARY1_BITS)-1);
+    if(MayCross(m_min1[k1],m_max1[k1],threshold,above)){
+      int64_t x=ScanReverse(p,q,threshold,above);
+      if(x>q) return x;
+    }
+    p=q;
+  }
+  return to;
+}
+
+// Sum of counters in [from,to).
+template<typename narrow_t>
+uint64_t CCoverageCounter<narrow_t>::Sum(int64_t from, int64_t to) const{
+  uint64_t s=0;
+  for(int64_t p=from;p<to;){
+    int64_t i=p & m_mask;
+    int64_t block=i>>BLOCK_BITS;
+    int64_t n=std::min(to-p,((block+1)<<BLOCK_BITS)-i);
+    const uint32_t* w=m_wide[block];
+    if(w) s+=CCoverageScan<uint32_t>::Sum(w+(i&(BLOCK_SIZE-1)),n);
+    else  s+=CCoverageScan<narrow_t>::Sum(m_narrow+i,n);
+    p+=n;
+  }
+  return s;
+}
+
+// Add the number of bases in [from,to) with each coverage to histogram[0..limit];
+// coverage at or above limit is counted at limit. With a summary, a range of
+// SUMMARY1_SIZE bases whose min equals max is counted at once.
+template<typename narrow_t>
+void CCoverageCounter<narrow_t>::CountValues(int64_t from, int64_t to, uint32_t limit, int64_t* histogram) const{
+  const bool clamp_narrow = limit<std::numeric_limits<narrow_t>::max();
+  for(int64_t p=from;p<to;){
+    int64_t i=p & m_mask;
+    int64_t block=i>>BLOCK_BITS;
+    int64_t n=std::min(to-p,((block+1)<<BLOCK_BITS)-i);
+    if(HasSummary()){
+      int64_t k1=i>>SUMMARY1_BITS;
+      n=std::min(n,((k1+1)<<SUMMARY1_BITS)-i);
+      if(m_min1[k1]==m_max1[k1]){
+        histogram[std::min(m_min1[k1],limit)]+=n;
+        p+=n;
+        continue;
+      }
+    }
+    const uint32_t* w=m_wide[block];
+    if(w){
+      w+=i&(BLOCK_SIZE-1);
+      for(int64_t k=0;k<n;++k) ++histogram[std::min(w[k],limit)];
+    }else if(clamp_narrow){
+      const narrow_t* c=m_narrow+i;
+      for(int64_t k=0;k<n;++k) ++histogram[std::min<uint32_t>(c[k],limit)];
+    }else{
+      const narrow_t* c=m_narrow+i;
+      for(int64_t k=0;k<n;++k) ++histogram[c[k]];
+    }
+    p+=n;
+  }
+}
+
+#endif // _COVERAGE_COUNTER_H_
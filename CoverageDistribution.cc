@@ -77,3 +77,13 @@ void CCoverageDistribution::Write(std::ostream& stream) const{
   }
 }
 
+
+// double average, double variance, int32_t #values, int32_t #larger,
+// int32_t #indexes and int32_t counts of each index, in native byte order
+void CCoverageDistribution::WriteBinary(std::ostream& stream) const{
+  double v[2]={Average(),Variance()};
+  int32_t n[3]={m_n_values,m_n_larger,static_cast<int32_t>(m_distribution.size())};
+  stream.write(reinterpret_cast<const char*>(v),sizeof(v));
+  stream.write(reinterpret_cast<const char*>(n),sizeof(n));
+  if(!m_distribution.empty()) stream.write(reinterpret_cast<const char*>(&m_distribution[0]),m_distribution.size()*sizeof(int32_t));
+}
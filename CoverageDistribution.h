@@ -47,6 +47,7 @@ public:
   inline double Average()  const {return m_sum/m_n_values;}
   inline double Variance() const {double a=Average(); return m_sum_squared/m_n_values-a*a;}
   void Write(std::ostream& stream) const;
+  void WriteBinary(std::ostream& stream) const;
 };
 
 #endif // _COVERAGE_DISTRIBUTION_H_
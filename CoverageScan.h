@@ -0,0 +1,143 @@
+/**
+ * @file    CoverageScan.h
+ * @brief   Vectorized threshold-crossing search and sums over coverage counters
+ */
+
+#ifndef _COVERAGE_SCAN_H_
+#define _COVERAGE_SCAN_H_
+
+#include <stdint.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define COVERAGE_SCAN_SIMD 32
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define COVERAGE_SCAN_SIMD 16
+#endif
+
+/**
+ * @brief Scan an array of counters for the first or last one on a given side of a threshold
+ *
+ * Forward() returns the first index i in [0,n) where (p[i]>=t)==above, or n.
+ * Reverse() returns the last such index, or -1. Sum() adds up p[0..n).
+ *
+ * The generic version is scalar. uint8_t and uint16_t are compared 16 or 32
+ * bytes at a time with SSE2 or AVX2 (build with -mavx2 to use the latter):
+ * p>=t holds exactly when the saturated difference t-p is zero.
+ */
+template<typename T>
+struct CCoverageScan {
+  static int64_t Forward(const T* p, int64_t n, T t, bool above){
+    for(int64_t i=0;i<n;++i) if((p[i]>=t)==above) return i;
+    return n;
+  }
+  static int64_t Reverse(const T* p, int64_t n, T t, bool above){
+    for(int64_t i=n-1;i>=0;--i) if((p[i]>=t)==above) return i;
+    return -1;
+  }
+  static uint64_t Sum(const T* p, int64_t n){
+    uint64_t s=0;
+    for(int64_t i=0;i<n;++i) s+=p[i];
+    return s;
+  }
+};
+
+#ifdef COVERAGE_SCAN_SIMD
+
+#if COVERAGE_SCAN_SIMD==32
+typedef __m256i coverage_simd_t;
+static const uint32_t COVERAGE_SIMD_FULL_MASK=0xFFFFFFFFU;
+inline coverage_simd_t CoverageSimdLoad(const void* p){return _mm256_loadu_si256(static_cast<const __m256i*>(p));}
+inline coverage_simd_t CoverageSimdSet8 (uint8_t  t){return _mm256_set1_epi8 (static_cast<char>(t));}
+inline coverage_simd_t CoverageSimdSet16(uint16_t t){return _mm256_set1_epi16(static_cast<short>(t));}
+inline uint32_t CoverageSimdAbove8 (coverage_simd_t v, coverage_simd_t t){return _mm256_movemask_epi8(_mm256_cmpeq_epi8 (_mm256_subs_epu8 (t,v),_mm256_setzero_si256()));}
+inline uint32_t CoverageSimdAbove16(coverage_simd_t v, coverage_simd_t t){return _mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_subs_epu16(t,v),_mm256_setzero_si256()));}
+inline uint64_t CoverageSimdSum8(const uint8_t* p, int64_t n, int64_t *done){
+  __m256i acc=_mm256_setzero_si256();
+  int64_t i=0;
+  for(;i+32<=n;i+=32) acc=_mm256_add_epi64(acc,_mm256_sad_epu8(CoverageSimdLoad(p+i),_mm256_setzero_si256()));
+  uint64_t s[4];
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(s),acc);
+  *done=i;
+  return s[0]+s[1]+s[2]+s[3];
+}
+#else
+typedef __m128i coverage_simd_t;
+static const uint32_t COVERAGE_SIMD_FULL_MASK=0xFFFFU;
+inline coverage_simd_t CoverageSimdLoad(const void* p){return _mm_loadu_si128(static_cast<const __m128i*>(p));}
+inline coverage_simd_t CoverageSimdSet8 (uint8_t  t){return _mm_set1_epi8 (static_cast<char>(t));}
+inline coverage_simd_t CoverageSimdSet16(uint16_t t){return _mm_set1_epi16(static_cast<short>(t));}
+inline uint32_t CoverageSimdAbove8 (coverage_simd_t v, coverage_simd_t t){return _mm_movemask_epi8(_mm_cmpeq_epi8 (_mm_subs_epu8 (t,v),_mm_setzero_si128()));}
+inline uint32_t CoverageSimdAbove16(coverage_simd_t v, coverage_simd_t t){return _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_subs_epu16(t,v),_mm_setzero_si128()));}
+inline uint64_t CoverageSimdSum8(const uint8_t* p, int64_t n, int64_t *done){
+  __m128i acc=_mm_setzero_si128();
+  int64_t i=0;
+  for(;i+16<=n;i+=16) acc=_mm_add_epi64(acc,_mm_sad_epu8(CoverageSimdLoad(p+i),_mm_setzero_si128()));
+  uint64_t s[2];
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(s),acc);
+  *done=i;
+  return s[0]+s[1];
+}
+#endif
+
+inline coverage_simd_t CoverageSimdSet(uint8_t  t){return CoverageSimdSet8(t);}
+inline coverage_simd_t CoverageSimdSet(uint16_t t){return CoverageSimdSet16(t);}
+inline uint32_t CoverageSimdAbove(const uint8_t*  p, coverage_simd_t t){return CoverageSimdAbove8 (CoverageSimdLoad(p),t);}
+inline uint32_t CoverageSimdAbove(const uint16_t* p, coverage_simd_t t){return CoverageSimdAbove16(CoverageSimdLoad(p),t);}
+
+// Shared by uint8_t and uint16_t; the byte mask has sizeof(T) bits per element.
+template<typename T>
+struct CCoverageSimdScan {
+  static const int64_t LANES=COVERAGE_SCAN_SIMD/sizeof(T);
+  static int64_t Forward(const T* p, int64_t n, T t, bool above){
+    coverage_simd_t tv=CoverageSimdSet(t);
+    int64_t i=0;
+    for(;i+LANES<=n;i+=LANES){
+      uint32_t m=CoverageSimdAbove(p+i,tv);
+      if(!above) m = ~m & COVERAGE_SIMD_FULL_MASK;
+      if(m) return i+__builtin_ctz(m)/sizeof(T);
+    }
+    for(;i<n;++i) if((p[i]>=t)==above) return i;
+    return n;
+  }
+  static int64_t Reverse(const T* p, int64_t n, T t, bool above){
+    coverage_simd_t tv=CoverageSimdSet(t);
+    int64_t i=n;
+    for(;i>=LANES;){
+      i-=LANES;
+      uint32_t m=CoverageSimdAbove(p+i,tv);
+      if(!above) m = ~m & COVERAGE_SIMD_FULL_MASK;
+      if(m) return i+(31-__builtin_clz(m))/sizeof(T);
+    }
+    for(--i;i>=0;--i) if((p[i]>=t)==above) return i;
+    return -1;
+  }
+};
+
+template<>
+struct CCoverageScan<uint8_t> {
+  static int64_t Forward(const uint8_t* p, int64_t n, uint8_t t, bool above){return CCoverageSimdScan<uint8_t>::Forward(p,n,t,above);}
+  static int64_t Reverse(const uint8_t* p, int64_t n, uint8_t t, bool above){return CCoverageSimdScan<uint8_t>::Reverse(p,n,t,above);}
+  static uint64_t Sum(const uint8_t* p, int64_t n){
+    int64_t i=0;
+    uint64_t s=CoverageSimdSum8(p,n,&i);
+    for(;i<n;++i) s+=p[i];
+    return s;
+  }
+};
+
+template<>
+struct CCoverageScan<uint16_t> {
+  static int64_t Forward(const uint16_t* p, int64_t n, uint16_t t, bool above){return CCoverageSimdScan<uint16_t>::Forward(p,n,t,above);}
+  static int64_t Reverse(const uint16_t* p, int64_t n, uint16_t t, bool above){return CCoverageSimdScan<uint16_t>::Reverse(p,n,t,above);}
+  static uint64_t Sum(const uint16_t* p, int64_t n){
+    uint64_t s=0;
+    for(int64_t i=0;i<n;++i) s+=p[i];
+    return s;
+  }
+};
+
+#endif // COVERAGE_SCAN_SIMD
+
+#endif // _COVERAGE_SCAN_H_
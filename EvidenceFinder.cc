@@ -12,6 +12,7 @@
 #include <limits>
 #include <cmath>
 #include <cstring>
+#include <sstream>
 
 #ifdef BITVECTOR_LIB_BEGIN
 using namespace BitVectorLib;
@@ -36,6 +37,13 @@ void CEvidenceFinderFeatures::Show(std::ostream& stream) const {
   stream<<std::endl;
 }
 
+void CEvidenceFinderFeatures::Add(const CEvidenceFinderFeatures& other){
+  for(int32_t i=0;i<=N_FEATURES;++i){
+    if(i==MAX_QUEUE_SIZE) GetMax(i,other.m_count[i]);
+    else m_count[i]+=other.m_count[i];
+  }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 /*
 bool CEvidenceFinder::comp_t::operator()(int32_t a, int32_t b) const {
@@ -50,15 +58,21 @@ bool CEvidenceFinder::comp_t::operator()(int32_t a, int32_t b) const {
 */
 
 //CEvidenceFinder::CEvidenceFinder() : m_comparator(this) {
-CEvidenceFinder::CEvidenceFinder(){
-  m_n_bins = GenomeSize()/BIN_SIZE+1;
-  std::cerr<<"# genome_size="<<GenomeSize()<<std::endl;
-  if(m_n_bins<=1) m_n_bins=MAX_GENOME_SIZE/BIN_SIZE+1;
-  std::cerr<<"# #bins="<<m_n_bins<<std::endl;
-  //m_SVs = new std::vector<CGeneralFeature>::const_iterator[m_n_bins];
-  m_SV_index = new int32_t[m_n_bins];
-  m_slots = new aln_t[MAX_N_READS];
-  m_slot_manager.SetUp(MAX_N_READS);
+CEvidenceFinder::CEvidenceFinder() : m_known(SameQName,this) {
+  m_out=&std::cout;
+  m_log=&std::cerr;
+  m_write_header=true;
+  m_slot_manager.SetUp(SLOT_SEGMENT_SIZE);
+  FollowSlotSegments();
+  m_known.SetUp(EXPECTED_N_READS);
+  for(int32_t i=0;i<N_ADMISSIONS;++i) m_admission[i]=0;
+  m_region_mode=false;
+  m_region_index=0;
+  m_n_treated=0;
+  m_previous_start=NO_POSITION;
+  m_final_out=0;
+  m_insert_quantile = Option().RequireDouble("insert-quantile");
+  if(m_insert_quantile<0 || m_insert_quantile>1) Quit("Quantile of insert sizes must be in (0,1]: "<<m_insert_quantile);
   m_dangling_distance = Option().RequireInteger("dangling-distance");
   std::cerr<<"# dangling reads will be reported if within "<<m_dangling_distance<<std::endl;
   const char *v = Option().Require("output-stderr");
@@ -72,137 +86,437 @@ CEvidenceFinder::CEvidenceFinder(){
   }
 }
 
+CEvidenceFinder::~CEvidenceFinder(){
+  for(uint32_t i=0;i<m_slot_segments.size();++i) delete m_slot_segments[i];
+}
+
+// Slots are kept per segment of the slot manager, each on a huge page if possible
+void CEvidenceFinder::FollowSlotSegments(){
+  while(m_slot_segments.size()<static_cast<uint32_t>(m_slot_manager.NSegments())){
+    CLargeMemory* segment = new CLargeMemory;
+    segment->Allocate(CLargeMemory::HUGE_PAGE_SIZE);
+    if(Option().Find("verbose")) std::cerr<<"# slot segment "<<m_slot_segments.size()<<": "<<segment->Bytes()<<" bytes, backing="<<segment->BackingName()<<std::endl;
+    m_slot_segments.push_back(segment);
+  }
+  while(m_slot_segments.size()>static_cast<uint32_t>(m_slot_manager.NSegments())){
+    delete m_slot_segments.back();
+    m_slot_segments.pop_back();
+  }
+}
+
 void CEvidenceFinder::MakeBin(const CGeneralFeatureVector& variants){
-  int32_t k=0;
   m_variants = &variants;
-  for(uint32_t i=0;i<variants.size();++i){
-    const CGeneralFeature& gf = variants[i];
-    while(k<=gf.Start()/BIN_SIZE){
-      if(k>=m_n_bins) Quit("Alignment beyond # of bins: m_n_bins="<<m_n_bins<<", k="<<k<<", gf="<<gf);
-      m_SV_index[k]=i;
-      ++k;
-    }
+  m_overlapping_reads.assign(variants.size(),supporters_t());
+  m_call_starts.clear();
+  for(uint32_t i=0;i<variants.size();++i) m_call_starts.push_back(std::make_pair(variants[i].Start(),i));
+  std::sort(m_call_starts.begin(),m_call_starts.end());
+  m_max_end_call.clear();
+  for(uint32_t k=0;k<m_call_starts.size();++k){
+    uint32_t i=m_call_starts[k].second;
+    m_max_end_call.push_back( k>0 && variants[m_max_end_call[k-1]].End()>=variants[i].End() ? m_max_end_call[k-1] : i );
+  }
+}
+
+// Among the calls starting before end, the one ending last is the nearest;
+// among the others, the one starting first. Returns -1 if there is no call.
+int64_t CEvidenceFinder::NearestCall(int64_t start, int64_t end, uint32_t* index) const {
+  uint32_t k = std::lower_bound(m_call_starts.begin(),m_call_starts.end(),std::make_pair(end,static_cast<uint32_t>(0)))-m_call_starts.begin();
+  int64_t distance=-1;
+  if(k>0){
+    *index=m_max_end_call[k-1];
+    distance=std::max<int64_t>(0,start-(*m_variants)[*index].End());
+  }
+  if(k<m_call_starts.size() && (distance<0 || m_call_starts[k].first-end<distance)){
+    *index=m_call_starts[k].second;
+    distance=m_call_starts[k].first-end;
   }
-  while(k<m_n_bins){
-    m_SV_index[k]=variants.size();
-    ++k;
+  return distance;
+}
+
+// A pair supports a call when span_start is in [Start-d,Start] and span_end in [End,End+d],
+// where d is the dangling distance; only calls starting in the first range are looked at.
+void CEvidenceFinder::FindSpannedCalls(int64_t span_start, int64_t span_end){
+  m_spanned.clear();
+  std::vector<std::pair<int64_t,uint32_t> >::const_iterator it
+    = std::lower_bound(m_call_starts.begin(),m_call_starts.end(),std::make_pair(span_start,static_cast<uint32_t>(0)));
+  for(;it!=m_call_starts.end() && it->first<=span_start+m_dangling_distance;++it){
+    const CGeneralFeature& sv = (*m_variants)[it->second];
+    if(sv.End()<=span_end && span_end<=sv.End()+m_dangling_distance) m_spanned.push_back(it->second);
   }
-  m_overlapping_reads = new std::vector<std::string>[variants.size()];
+}
+
+void CEvidenceFinder::SetOutput(std::ostream& out, std::ostream& log, bool write_header){
+  m_out=&out;
+  m_log=&log;
+  m_write_header=write_header;
 }
 
 void CEvidenceFinder::TreatHeader(const char *text){
-  std::cout<<text<<std::endl;
+  if(m_write_header) (*m_out)<<text<<'\n';
+}
+
+// QNAME is the first field of the SAM line
+bool CEvidenceFinder::SameQName(const void* finder, int32_t slot, const char* qname){
+  const CEvidenceFinder* f = static_cast<const CEvidenceFinder*>(finder);
+  const char* p = f->Text(f->Slot(slot));
+  while(*qname && *p==*qname){++p; ++qname;}
+  return *qname=='\0' && (*p=='\t' || *p=='\0');
+}
+
+// Wait for the mate of the read
+void CEvidenceFinder::Keep(int64_t start, int64_t end, int64_t pnext, uint64_t hash, const char *text){
+  int32_t slot=m_slot_manager.Allocate();
+  if(slot<1) Quit("Too many reads to remember: "<<m_slot_manager.Size());
+  FollowSlotSegments();
+  pending_t& p=Slot(slot);
+  p.Start=start;
+  p.End=end;
+  p.PNext=pnext;
+  p.QNameHash=hash;
+  p.Length=std::strlen(text);
+  p.Text=m_texts.Push(text);
+  p.Used=false;
+  m_known.Insert(hash,slot);
+  QueuePush(slot);
+  GetMax(MAX_QUEUE_SIZE,QueueSize());
 }
 
 void CEvidenceFinder::Treat(const CSAMAlignment& downstream, const char *text){
-  std::string qname(downstream.QName());
-
-  _COVERAGE_ARRAY_BV_NS_ str2int_t::iterator iter=m_known.find(qname);
-  if( m_known.find(qname)==m_known.end() ){
-    int32_t slot=m_slot_manager.Allocate();
-    if(slot<1) Quit("Too many reads to remember: "<<m_slot_manager.Size());
-    m_slots[slot].Import(downstream,text);
-    m_known[qname] = slot;
-    QueuePush(slot);
-    GetMax(MAX_QUEUE_SIZE,QueueSize());
+  // A pair is paired and counted through its primary alignments only
+  if(downstream.IsSecondaryAlignment() || downstream.IsSupplementaryAlignment()){
+    ++m_admission[ADMIT_NOT_PRIMARY];
+    return;
+  }
+  ++m_n_treated;
+  if(m_insert_quantile>0) SampleInsertSize(downstream);
+  uint64_t hash=CQNameTable::Hash(downstream.QName());
+  int32_t known=m_known.Take(downstream.QName(),hash);
+  if( known==CQNameTable::EMPTY ){
+    if(m_region_mode && IsOrphan(downstream)) AddOrphan(downstream,text,hash);
+    else if(Admit(downstream,text)) Keep(downstream.Start(),downstream.End(),downstream.PNext(),hash,text);
+  }else if( known==CQNameTable::RETIRED ){
+    // The mate has already been counted and its slot released
   }else{
-    aln_t& upstream=m_slots[(*iter).second];
-    int32_t bin=upstream.Start()/BIN_SIZE;
-    int64_t span_start = upstream.  End()  -MarginSize();
+    pending_t& upstream=Slot(known);
+    int64_t span_start = upstream.End        -MarginSize();
     int64_t span_end   = downstream.Start()+MarginSize();
-    for(uint32_t i=m_SV_index[bin];i<m_variants->size();++i){
-      const CGeneralFeature& sv = (*m_variants)[i];
-      if(downstream.End() < sv.Start()) break;
-      if(sv.Start()-m_dangling_distance<=span_start && // Mon Jan  9 23:17:34 2012
-         span_start <= sv.Start() &&
-         sv.End()<=span_end &&
-         span_end<=sv.End()+m_dangling_distance){
-        int32_t is_discordant=1;
-        std::ostringstream oss;
-        const char *lb=downstream.Option("LB");
-        const char *thr=lb?LibraryThreshold(lb):0;
-        if(!thr){
-          lb=downstream.Option("RG");
-          thr=lb?LibraryThreshold(lb):0;
-        }
-        //std::cerr<<"lb="<<(lb?lb:"N/A")<<", thr="<<(thr?thr:"N/A")<<std::endl;
-        if(thr){
-          int32_t w=std::atof(thr);
-          int32_t len=downstream.End()-upstream.Start();
-          if(len<w) is_discordant=0;
-          oss<<"\tYT:f:"<<thr<<"\tYL:i:"<<len<<"\tYD:i:"<<is_discordant;
-        }
-        std::cout<<upstream.Text()<<oss.str()<<std::endl;
-        std::cout<<text<<oss.str()<<std::endl;
-        qname+=':';
-        qname+=lb?lb:"NA";
-        if(thr) qname+=(is_discordant?":d":":c");
-        m_overlapping_reads[i].push_back(qname);
-        break;
-      }
+    FindSpannedCalls(span_start,span_end);
+    if(!m_spanned.empty()){
+      int32_t lib=Library(downstream);
+      WriteSpanningPair(upstream,downstream.End(),text,downstream.QName(),lib!=NO_LIBRARY? &LibraryAt(lib): 0,Key());
     }
-    upstream.SetUsed();
-    m_known.erase(iter);
+    upstream.Used=true;
   }
 
   Flush(downstream.Start()-BIN_SIZE);
+  m_previous_start=downstream.Start();
+}
+
+// Both reads of a pair spanning the calls in m_spanned, which get its name
+void CEvidenceFinder::WriteSpanningPair(const pending_t& upstream, int64_t end, const char *text, const char *qname, const library_t* lib, uint64_t key){
+  int32_t is_discordant=1;
+  int32_t len=end-upstream.Start;
+  bool thr = lib && lib->HasThreshold();
+  if(thr && len<lib->MinDiscordantLength) is_discordant=0;
+  WriteSpanningRead(Text(upstream),lib,len,is_discordant);
+  WriteSpanningRead(text,          lib,len,is_discordant);
+  std::string name(qname);
+  name+=':';
+  name+=lib? lib->Name.c_str(): "NA";
+  if(thr) name+=(is_discordant?":d":":c");
+  else if(Estimating(lib)) name+=Mark('N',lib->Name,len);
+  // Every call the pair spans, including nested and overlapping ones
+  for(uint32_t i=0;i<m_spanned.size();++i) m_overlapping_reads[m_spanned[i]].push_back(std::make_pair(key,name));
+}
+
+static void write_tags(std::ostream& out, const std::string& threshold, int32_t len, int32_t is_discordant){
+  out<<"\tYT:f:"<<threshold<<"\tYL:i:"<<len<<"\tYD:i:"<<is_discordant;
+}
+
+// The SAM line, followed by YT, YL and YD if the library has a threshold
+void CEvidenceFinder::WriteSpanningRead(const char *text, const library_t* lib, int32_t len, int32_t is_discordant){
+  std::ostream& out = *m_out;
+  out<<text;
+  if(lib && lib->HasThreshold()) write_tags(out,lib->Threshold,len,is_discordant);
+  else if(Estimating(lib)) out<<Mark('S',lib->Name,len);
+  out<<'\n';
+}
+
+void CEvidenceFinder::CountUnpaired(int64_t start, int64_t end, int64_t pnext, const char *text){
+  int64_t d=pnext-start;
+  if(d<0) d=-d;
+  if(d>BIN_SIZE){
+    OneMore(TOOFAR);
+    return;
+  }
+  uint32_t nearest_index;
+  int64_t nearest_distance = NearestCall(start, end, &nearest_index);
+  if(nearest_distance<0 || nearest_distance>=m_dangling_distance) OneMore(DANGLING_INDEPENDENT);
+  else{
+    //std::cout<<"Dangling: "<<leftmost<<std::endl;
+    //std::cout<<"nearest:  "<<(*nearest_iter)<<std::endl;
+    //std::cout<<"nearest:  "<<(*m_variants)[nearest_index]<<std::endl;
+    //m_feature_dangling_near_sv++;
+    if(m_output_stderr=='D'){
+      (*m_log)<<"# nearest of the following:  "<<(*m_variants)[nearest_index]<<'\n';
+      (*m_log)<<text<<'\n';
+    }
+    OneMore(DANGLING_NEAR_SV);
+  }
+}
+
+// Decide from FLAG, RNEXT and PNEXT whether a read without a pending mate has to wait
+// for its mate. Reads that need not wait are counted here as they would be by Flush.
+bool CEvidenceFinder::Admit(const CSAMAlignment& aln, const char *text){
+  if(!MateOnSameReference(aln)){
+    CountUnpaired(aln.Start(), aln.End(), aln.PNext(), text);
+    ++m_admission[ADMIT_NO_MATE];
+    return false;
+  }
+  // The mate came first and was not kept; the pair has been counted with it
+  if(aln.PNext()<aln.Start()){
+    ++m_admission[ADMIT_COUNTED];
+    return false;
+  }
+  // Either read may come first, or the mate may come after this read is flushed
+  if(aln.PNext()==aln.Start() || aln.PNext()>=aln.End()+BIN_SIZE){
+    ++m_admission[ADMIT_KEPT];
+    return true;
+  }
+  FindSpannedCalls(aln.End()-MarginSize(), aln.PNext()+MarginSize());
+  if(!m_spanned.empty()){
+    ++m_admission[ADMIT_KEPT];
+    return true;
+  }
+  // The mate comes before this read would be flushed, and the pair spans no call
+  OneMore(PAIRED);
+  ++m_admission[ADMIT_PAIRED];
+  return false;
+}
+
+bool CEvidenceFinder::MateOnSameReference(const CSAMAlignment& aln){
+  return aln.IsMultipleFragments() && !aln.IsNextUnmapped() &&
+    (std::strcmp(aln.RNext(),"=")==0 || std::strcmp(aln.RNext(),aln.RName())==0);
 }
 
 void CEvidenceFinder::Flush(int64_t position){
   while(! QueueEmpty() ){
     int32_t slot = QueueTop();
-    aln_t& leftmost = m_slots[ slot ];
-    if(position < leftmost.End()) break;
-    int64_t d=leftmost.PNext()-leftmost.Pos();
-    if(d<0) d=-d;
-    if( leftmost.IsUsed() ) OneMore(PAIRED);
-    else if(d>BIN_SIZE) OneMore(TOOFAR);
-    else{
-      // Look for the nearest
-      int32_t bin=leftmost.Start()/BIN_SIZE-1;
-      if(bin<0) bin=0;
-      int32_t nearest_index=m_SV_index[bin];
-      const CGeneralFeature& sv0=(*m_variants)[nearest_index];
-      int64_t nearest_distance = interval_distance( sv0.Start(), sv0.End(), leftmost.Start(), leftmost.End() );
-      for(uint32_t i=nearest_index;i<m_variants->size();++i){
-        const CGeneralFeature& sv=(*m_variants)[i];
-        int64_t distance = interval_distance( sv.Start(), sv.End(), leftmost.Start(), leftmost.End() );
-        if(nearest_distance>distance){
-          nearest_distance = distance;
-          nearest_index=i;
-        }
-        if(distance>=BIN_SIZE) break;
-      }
+    pending_t& leftmost = Slot(slot);
+    if(position < leftmost.End) break;
+    if( leftmost.Used ) OneMore(PAIRED);
+    else CountUnpaired(leftmost.Start, leftmost.End, leftmost.PNext, Text(leftmost));
+    // The mate may still come; remember the name but not the slot
+    if( !leftmost.Used ) m_known.Retire(leftmost.QNameHash,slot);
+    m_texts.PopUntil(leftmost.Text+leftmost.Length+1);
+    QueuePop();
+    m_slot_manager.Release(slot);
+    FollowSlotSegments();
+  }
+}
+
+void CEvidenceFinder::ShowAdmission() const {
+  if(!Option().Find("verbose")) return;
+  (*m_log)<<"# admission: kept="<<m_admission[ADMIT_KEPT]<<", no mate="<<m_admission[ADMIT_NO_MATE]
+          <<", paired on arrival="<<m_admission[ADMIT_PAIRED]<<", counted with mate="<<m_admission[ADMIT_COUNTED]
+          <<", not primary="<<m_admission[ADMIT_NOT_PRIMARY]<<'\n';
+}
 
-      if(nearest_distance>=m_dangling_distance) OneMore(DANGLING_INDEPENDENT);
-      else{
-        //std::cout<<"Dangling: "<<leftmost<<std::endl;
-        //std::cout<<"nearest:  "<<(*nearest_iter)<<std::endl;
-        //std::cout<<"nearest:  "<<(*m_variants)[nearest_index]<<std::endl;
-        //m_feature_dangling_near_sv++;
-        if(m_output_stderr=='D'){
-          std::cerr<<"# nearest of the following:  "<<(*m_variants)[nearest_index]<<std::endl;
-          std::cerr<<leftmost.Text()<<std::endl;
-        }
-        OneMore(DANGLING_NEAR_SV);
+void CEvidenceFinder::Report(){
+  ShowAdmission();
+  if(m_out==&m_deferred){
+    EstimateThresholds();
+    WriteResolved(*m_final_out,m_deferred.str());
+    m_deferred.str("");
+    m_out=m_final_out;
+  }
+  if(m_output_stderr=='V'){
+    for(uint32_t i=0;i<m_variants->size();++i){
+      (*m_log)<<(*m_variants)[i];
+      const supporters_t& overlapping_reads = m_overlapping_reads[i];
+      foreach_const(supporters_t, iter, overlapping_reads){
+        (*m_log)<<'\t';
+        WriteResolved(*m_log,iter->second);
       }
+      (*m_log)<<'\n';
     }
-    QueuePop();
-    m_slot_manager.Release(slot);
   }
+  CEvidenceFinderFeatures::Show(*m_log);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Each pair is sampled once, through its read with positive TLEN
+void CEvidenceFinder::SampleInsertSize(const CSAMAlignment& aln){
+  if(!aln.IsProperlyAligned() || aln.IsNextUnmapped() || aln.TLen()<=0) return;
+  int32_t lib=Library(aln);
+  if(lib==NO_LIBRARY || LibraryAt(lib).HasThreshold()) return;
+  if(lib>=static_cast<int32_t>(m_insert_size_of.size())) m_insert_size_of.resize(NLibraries(),0);
+  if(!m_insert_size_of[lib]) m_insert_size_of[lib]=&m_insert_sizes[LibraryAt(lib).Name];
+  m_insert_size_of[lib]->Add(aln.TLen());
+}
+
+// "<MARK><kind><library><MARK_LENGTH><len><MARK>", where kind is 'S' for the tags
+// of a SAM line and 'N' for the suffix of a read-pair name
+std::string CEvidenceFinder::Mark(char kind, const std::string& library, int32_t len){
+  std::ostringstream oss;
+  oss<<MARK<<kind<<library<<MARK_LENGTH<<len<<MARK;
+  return oss.str();
+}
+
+// Keep the output until the thresholds are estimated; Report() writes it
+void CEvidenceFinder::Defer(){
+  if(m_insert_quantile<=0 || m_out==&m_deferred) return;
+  m_final_out=m_out;
+  m_out=&m_deferred;
+}
+
+void CEvidenceFinder::EstimateThresholds(){
+  m_estimated.clear();
+  for(std::map<std::string,CInsertSizeSketch>::const_iterator it=m_insert_sizes.begin();it!=m_insert_sizes.end();++it){
+    const CInsertSizeSketch& sizes = it->second;
+    if(sizes.Count()<MIN_INSERT_SAMPLES){
+      (*m_log)<<"# library "<<it->first<<": only "<<sizes.Count()<<" insert sizes, no threshold estimated\n";
+      continue;
+    }
+    int64_t size=sizes.Quantile(m_insert_quantile);
+    std::ostringstream threshold;
+    threshold<<size;
+    library_t lib;
+    lib.Name=it->first;
+    lib.Threshold=threshold.str();
+    lib.MinDiscordantLength=size;
+    m_estimated[lib.Name]=lib;
+    (*m_log)<<"# library "<<lib.Name<<": threshold "<<lib.Threshold<<" at quantile "<<m_insert_quantile<<" of "<<sizes.Count()<<" insert sizes\n";
+  }
+}
+
+// Replace the marks with the tags or 'd'/'c' as the estimated thresholds give,
+// or with nothing for libraries with too few insert sizes
+void CEvidenceFinder::WriteResolved(std::ostream& out, const std::string& text) const {
+  std::string::size_type p=0;
+  for(;;){
+    std::string::size_type b=text.find(MARK,p);
+    if(b==std::string::npos) break;
+    std::string::size_type m=text.find(MARK_LENGTH,b);
+    std::string::size_type e=text.find(MARK,m);
+    out.write(text.data()+p,b-p);
+    std::map<std::string,library_t>::const_iterator it = m_estimated.find(text.substr(b+2,m-b-2));
+    if(it!=m_estimated.end()){
+      int32_t len=std::atoi(text.c_str()+m+1);
+      int32_t is_discordant = len<it->second.MinDiscordantLength? 0: 1;
+      if(text[b+1]=='S') write_tags(out,it->second.Threshold,len,is_discordant);
+      else out<<(is_discordant?":d":":c");
+    }
+    p=e+1;
+  }
+  out.write(text.data()+p,text.size()-p);
 }
 
 void CEvidenceFinder::ReadSAM(const char *sam_file, CChromosomeNormalizer& cn){
+  Defer();
   CSAMReader::ReadSAM(sam_file,cn);
   Flush(MaxPosition());
-  if(m_output_stderr=='V'){
-    for(uint32_t i=0;i<m_variants->size();++i){
-      std::cerr<<(*m_variants)[i];
-      const std::vector<std::string>& overlapping_reads = m_overlapping_reads[i];
-      foreach_const(std::vector<std::string>, iter, overlapping_reads) std::cerr<<'\t'<<(*iter);
-      std::cerr<<std::endl;
+  Report();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void CEvidenceFinder::SetRegion(int32_t index, int64_t begin, int64_t end){
+  m_region_mode=true;
+  m_region_index=index;
+  CSAMReader::SetRegion(begin,end);
+}
+
+// The mate starts before the region; only the merger can know if it is pending.
+// Treat() has already skipped secondary and supplementary alignments.
+bool CEvidenceFinder::IsOrphan(const CSAMAlignment& aln) const {
+  return MateOnSameReference(aln) && aln.PNext()<RegionBegin();
+}
+
+void CEvidenceFinder::AddOrphan(const CSAMAlignment& aln, const char *text, uint64_t hash){
+  orphan_t o;
+  o.Start=aln.Start();
+  o.End=aln.End();
+  o.PreviousStart=m_previous_start;
+  o.QNameHash=hash;
+  o.QName=aln.QName();
+  o.Text=text;
+  int32_t lib=Library(aln);
+  o.HasLibrary = lib!=NO_LIBRARY;
+  if(o.HasLibrary) o.Library=LibraryAt(lib);
+  o.Key=Key();
+  o.OutputOffset=m_out->tellp();
+  m_orphans.push_back(o);
+}
+
+// Reads still pending are handed over without being flushed
+void CEvidenceFinder::ReadRegion(const char *sam_file, CChromosomeNormalizer& cn, region_t* result){
+  CSAMReader::ReadSAM(sam_file,cn);
+  result->Mates.clear();
+  while(! QueueEmpty() ){
+    int32_t slot = QueueTop();
+    pending_t& p = Slot(slot);
+    if( p.Used ) OneMore(PAIRED);
+    else{
+      mate_t m;
+      m.Start=p.Start;
+      m.End=p.End;
+      m.PNext=p.PNext;
+      m.QNameHash=p.QNameHash;
+      m.Text=Text(p);
+      result->Mates.push_back(m);
+    }
+    m_texts.PopUntil(p.Text+p.Length+1);
+    QueuePop();
+    m_slot_manager.Release(slot);
+    FollowSlotSegments();
+  }
+  result->Orphans.swap(m_orphans);
+  result->Supporters.swap(m_overlapping_reads);
+  result->LastStart=m_previous_start;
+  result->MaxPosition=MaxPosition();
+  result->Admission.assign(m_admission,m_admission+N_ADMISSIONS);
+  result->Counts=*this;
+  result->InsertSizes.swap(m_insert_sizes);
+  m_insert_size_of.clear();
+}
+
+void CEvidenceFinder::MergeRegion(const region_t& region, const std::string& out, const std::string& log){
+  Defer();
+  (*m_log)<<log;
+  uint64_t written=0;
+  foreach_const(std::vector<orphan_t>, o, region.Orphans){
+    // As the serial finder would be when the orphan comes
+    if(o->PreviousStart!=NO_POSITION) Flush(o->PreviousStart-BIN_SIZE);
+    m_out->write(out.data()+written,o->OutputOffset-written);
+    written=o->OutputOffset;
+    int32_t known=m_known.Take(o->QName.c_str(),o->QNameHash);
+    if( known>0 ){
+      pending_t& upstream=Slot(known);
+      FindSpannedCalls(upstream.End-MarginSize(),o->Start+MarginSize());
+      if(!m_spanned.empty()) WriteSpanningPair(upstream,o->End,o->Text.c_str(),o->QName.c_str(),o->HasLibrary? &o->Library: 0,o->Key);
+      upstream.Used=true;
+    }else if( known==CQNameTable::EMPTY ){
+      // The mate was not kept; the pair has been counted with it
+      ++m_admission[ADMIT_COUNTED];
     }
   }
-  CEvidenceFinderFeatures::Show(std::cerr);
+  m_out->write(out.data()+written,out.size()-written);
+  if(region.LastStart!=NO_POSITION) Flush(region.LastStart-BIN_SIZE);
+  foreach_const(std::vector<mate_t>, m, region.Mates) Keep(m->Start,m->End,m->PNext,m->QNameHash,m->Text.c_str());
+  for(uint32_t i=0;i<region.Supporters.size();++i){
+    m_overlapping_reads[i].insert(m_overlapping_reads[i].end(),region.Supporters[i].begin(),region.Supporters[i].end());
+  }
+  for(int32_t i=0;i<N_ADMISSIONS && i<static_cast<int32_t>(region.Admission.size());++i) m_admission[i]+=region.Admission[i];
+  CEvidenceFinderFeatures::Add(region.Counts);
+  for(std::map<std::string,CInsertSizeSketch>::const_iterator it=region.InsertSizes.begin();it!=region.InsertSizes.end();++it){
+    m_insert_sizes[it->first].Merge(it->second);
+  }
+  UpdateMaxPosition(region.MaxPosition);
 }
 
+void CEvidenceFinder::FinishMerge(){
+  Flush(MaxPosition());
+  // Pairs found by the merger come between those of the regions
+  for(uint32_t i=0;i<m_overlapping_reads.size();++i) std::stable_sort(m_overlapping_reads[i].begin(),m_overlapping_reads[i].end());
+  Report();
+}
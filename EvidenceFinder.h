@@ -13,12 +13,15 @@
 #include <stdint.h>
 #include <vector>
 #include <queue>
+#include <map>
+#include <sstream>
 #include "Utility.h"
 #include "FileReader.h"
 #include "GeneralFeature.h"
 #include "SAMReader.h"
 #include "SAMAlignment.h"
 #include "Tool.h"
+#include "LargeMemory.h"
 
 #ifdef BITVECTOR_LIB_BEGIN
 #define _COVERAGE_ARRAY_BV_NS_ BitVectorLib::
@@ -46,10 +49,48 @@ class CEvidenceFinderFeatures {
  public:
   CEvidenceFinderFeatures();
   void Show(std::ostream& stream) const;
+  /// Sum of counts; the larger of the queue sizes
+  void Add(const CEvidenceFinderFeatures& other);
 };
 
 
 class CEvidenceFinder : public CSAMReader, public CEvidenceFinderFeatures {
+public:
+  /// Read-pair names supporting a call, with the order in which they were found
+  typedef std::vector<std::pair<uint64_t,std::string> > supporters_t;
+  /// A read still waiting for its mate at the end of a region
+  struct mate_t {
+    int64_t Start;
+    int64_t End;
+    int64_t PNext;
+    uint64_t QNameHash;
+    std::string Text;
+  };
+  /// A read whose mate starts in an earlier region
+  struct orphan_t {
+    int64_t Start;
+    int64_t End;
+    int64_t PreviousStart;   ///< Start of the read treated before it in the region, or NO_POSITION
+    uint64_t QNameHash;
+    std::string QName;
+    std::string Text;
+    bool HasLibrary;
+    library_t Library;
+    uint64_t Key;            ///< Order among the supporters of a call
+    uint64_t OutputOffset;   ///< Where its pair would be in the output of the region
+  };
+  /// What ReadRegion() leaves to MergeRegion()
+  struct region_t {
+    std::vector<mate_t> Mates;
+    std::vector<orphan_t> Orphans;
+    std::vector<supporters_t> Supporters;
+    int64_t LastStart;
+    int64_t MaxPosition;
+    std::vector<int64_t> Admission;
+    CEvidenceFinderFeatures Counts;
+    std::map<std::string,CInsertSizeSketch> InsertSizes;  ///< By library, with --insert-quantile
+  };
+  static const int64_t NO_POSITION=-1;
 private:
   /*
   class comp_t {
@@ -62,18 +103,15 @@ private:
   friend class comp_t;
   comp_t m_comparator;
   */
-  class aln_t : public CSAMAlignment {
-  private:
-    std::string m_text;
-    bool m_used;
-  public:
-    inline aln_t(){m_used=false;}
-    //inline aln_t(const CSAMAlignment& a){Copy(a); Used=false;}
-    //inline aln_t& operator=(const CSAMAlignment& a){Copy(a); Used=false; return *this;}
-    inline void Import(const CSAMAlignment& a, const char *text){CSAMAlignment::Copy(a); m_used=false; m_text=text;}
-    inline bool IsUsed() const {return m_used;}
-    inline void SetUsed(){m_used=true;}
-    inline const std::string& Text() const {return m_text;}
+  /// A read waiting for its mate; the SAM line is kept in m_texts
+  struct pending_t {
+    int64_t Start;
+    int64_t End;
+    int64_t PNext;
+    uint64_t QNameHash;
+    int64_t Text;
+    int32_t Length;
+    bool Used;
   };
   /*
   std::priority_queue<int32_t,std::vector<int32_t>, comp_t> m_position_queue;
@@ -83,15 +121,19 @@ private:
   inline int32_t QueueTop(){return m_position_queue.top();}
   inline int32_t QueueSize(){return m_position_queue.size();}
   */
-  static const int32_t MAX_GENOME_SIZE=300*1000*1000;
-  //static const int32_t MAX_N_READS=1000*1000;
-  static const int32_t MAX_N_READS=1000*1000;
+  static const int32_t EXPECTED_N_READS=128*1024;
+  static const int32_t SLOT_SEGMENT_SIZE=CLargeMemory::HUGE_PAGE_SIZE/sizeof(pending_t);
   static const int32_t BIN_SIZE=1000000;
-  //aln_t m_slots[MAX_N_READS];
   char m_output_stderr;
-  aln_t* m_slots;
-  std::vector<std::string>* m_overlapping_reads;
-  int32_t m_n_bins;
+  std::ostream* m_out;
+  std::ostream* m_log;
+  bool m_write_header;
+  std::vector<CLargeMemory*> m_slot_segments;
+  inline pending_t& Slot(int32_t slot) const {return static_cast<pending_t*>(m_slot_segments[slot/SLOT_SEGMENT_SIZE]->Pointer())[slot%SLOT_SEGMENT_SIZE];}
+  void FollowSlotSegments();
+  CTextQueue m_texts;
+  inline const char* Text(const pending_t& p) const {return m_texts.At(p.Text);}
+  std::vector<supporters_t> m_overlapping_reads;
   int32_t m_dangling_distance;
   std::deque<int32_t> m_position_queue;
   inline void QueuePush(int32_t slot){m_position_queue.push_back(slot);}
@@ -100,20 +142,84 @@ private:
   inline int32_t QueueTop(){return m_position_queue.front();}
   inline int32_t QueueSize(){return m_position_queue.size();}
 
-  //std::vector<CGeneralFeature>::const_iterator *m_SVs;
-  int32_t* m_SV_index;
   //std::vector<CGeneralFeature>::const_iterator m_end_iter;
   const std::vector<CGeneralFeature>* m_variants;
-  _COVERAGE_ARRAY_BV_NS_ str2int_t m_known;
+  std::vector<std::pair<int64_t,uint32_t> > m_call_starts;  // (start, index) of the calls in order
+  std::vector<uint32_t> m_max_end_call;  // call ending last among m_call_starts[0..k]
+  std::vector<uint32_t> m_spanned;
+  void FindSpannedCalls(int64_t span_start, int64_t span_end);
+  int64_t NearestCall(int64_t start, int64_t end, uint32_t* index) const;
+  // What Admit() did with reads that had no pending mate
+  static const int32_t ADMIT_KEPT=0;
+  static const int32_t ADMIT_NO_MATE=1;
+  static const int32_t ADMIT_PAIRED=2;
+  static const int32_t ADMIT_COUNTED=3;
+  static const int32_t ADMIT_NOT_PRIMARY=4;
+  static const int32_t N_ADMISSIONS=5;
+  int64_t m_admission[N_ADMISSIONS];
+  bool Admit(const CSAMAlignment& aln, const char *text);
+  static bool MateOnSameReference(const CSAMAlignment& aln);
+  // Region mode: alignments starting in [RegionBegin(),region end) of the chromosome
+  bool m_region_mode;
+  int32_t m_region_index;
+  uint64_t m_n_treated;
+  int64_t m_previous_start;
+  std::vector<orphan_t> m_orphans;
+  inline uint64_t Key() const {return (static_cast<uint64_t>(m_region_index)<<40)+m_n_treated;}
+  bool IsOrphan(const CSAMAlignment& aln) const;
+  void AddOrphan(const CSAMAlignment& aln, const char *text, uint64_t hash);
+  void Keep(int64_t start, int64_t end, int64_t pnext, uint64_t hash, const char *text);
+  void CountUnpaired(int64_t start, int64_t end, int64_t pnext, const char *text);
+  void WriteSpanningPair(const pending_t& upstream, int64_t end, const char *text, const char *qname, const library_t* lib, uint64_t key);
+  void WriteSpanningRead(const char *text, const library_t* lib, int32_t len, int32_t is_discordant);
+  // --insert-quantile: libraries without thresholds get the quantile of their insert
+  // sizes in the chromosome. Until all reads are read, their YT/YL/YD tags and 'd'/'c'
+  // are written as marks (see Mark()), and the output of the chromosome is kept in
+  // m_deferred instead of being written to m_out.
+  static const int64_t MIN_INSERT_SAMPLES=100;
+  static const char MARK='\x01';
+  static const char MARK_LENGTH='\x02';
+  double m_insert_quantile;
+  std::map<std::string,CInsertSizeSketch> m_insert_sizes;  // by library name
+  std::vector<CInsertSizeSketch*> m_insert_size_of;        // by library index
+  std::map<std::string,library_t> m_estimated;             // libraries given thresholds
+  std::ostream* m_final_out;
+  std::ostringstream m_deferred;
+  inline bool Estimating(const library_t* lib) const {return lib && !lib->HasThreshold() && m_insert_quantile>0;}
+  void SampleInsertSize(const CSAMAlignment& aln);
+  static std::string Mark(char kind, const std::string& library, int32_t len);
+  void Defer();
+  void EstimateThresholds();
+  void WriteResolved(std::ostream& out, const std::string& text) const;
+  CQNameTable m_known;
+  static bool SameQName(const void* finder, int32_t slot, const char* qname);
   CSlotManager m_slot_manager;
   void Flush(int64_t position);
   void Treat(const CSAMAlignment& aln, const char *text);
   void TreatHeader(const char *text);
+  void ShowAdmission() const;
+  void Report();
 public:
   CEvidenceFinder();
-  ~CEvidenceFinder(){delete [] m_slots; delete [] m_overlapping_reads;}
+  ~CEvidenceFinder();
   void MakeBin(const CGeneralFeatureVector& variants);
   void ReadSAM(const char *sam_file, CChromosomeNormalizer& cn);
+  /// Write to other streams than std::cout and std::cerr; the SAM header only if write_header.
+  void SetOutput(std::ostream& out, std::ostream& log, bool write_header);
+
+  /**
+   * A chromosome may be split into regions read by separate finders, each
+   * writing to its own std::ostringstream. ReadRegion() treats alignments
+   * starting in [begin,end) of the region given by SetRegion(), and leaves
+   * in result what needs the other regions: reads still waiting for their
+   * mates, and reads whose mates start in earlier regions. One more finder
+   * with the same calls passes the regions in order to MergeRegion(), which
+   * writes their output and pairs the reads left over, then FinishMerge().
+   */
+  void SetRegion(int32_t index, int64_t begin, int64_t end);
+  void ReadRegion(const char *sam_file, CChromosomeNormalizer& cn, region_t* result);
+  void MergeRegion(const region_t& region, const std::string& out, const std::string& log);
+  void FinishMerge();
 };
 
 #endif // _EVIDENCE_FINDER_H_
@@ -42,6 +42,11 @@ int32_t CChromosomeNormalizer::Chr(const char *refname){
   return chr;
 }
 
+// Add unknown reference names counted by a copy of this normalizer
+void CChromosomeNormalizer::MergeUnknown(const CChromosomeNormalizer& another){
+  foreach_const(_COVERAGE_ARRAY_BV_NS_ str2int_t, it, another.m_unknown_refname) m_unknown_refname[it->first] += it->second;
+}
+
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -66,7 +71,9 @@ void CGeneralFeatureVector::ReadGFF(int32_t chr, class CChromosomeNormalizer& cn
     if(gff.Start()==gff.End()) std::cerr<<"Range size 1: "<<fr.GetContentLine()<<std::endl;
 
     //if(Chr(gff.Name()) != m_chr) continue;
-    if(cn.Chr(gff.Name()) != chr) continue;
+    if(chr==CChromosomeNormalizer::ALL_CHROMOSOMES){
+      if(cn.Chr(gff.Name())==0) continue;
+    }else if(cn.Chr(gff.Name()) != chr) continue;
     //m_dbvar_variants.push_back(gff);
     push_back(gff);
     cl.IncrementChr();
@@ -66,14 +66,20 @@ public:
 inline std::ostream& operator<<(std::ostream& s, const CGeneralFeature& gf){gf.WriteBED(s); return s;}
 
 class CChromosomeNormalizer {
+ public:
+  static const int32_t ALL_CHROMOSOMES=-1; ///< Chromosome number that stands for every chromosome
  private:
   CKVStore m_kvs;
+  std::string m_source;
   _COVERAGE_ARRAY_BV_NS_ str2int_t m_unknown_refname;
  public:
-  void Read(const char* table_filename){m_kvs.Read(table_filename);}
+  void Read(const char* table_filename){m_kvs.Read(table_filename); m_source=table_filename;}
+  const char* Source() const {return m_source.c_str();}
   int32_t Chr(const char *refname);
   //const char* Find(const char *refname){return m_kvs.Find(refname);}
   void ShowUnknown(std::ostream &stream) const {stream<<m_unknown_refname<<std::endl;}
+  void MergeUnknown(const CChromosomeNormalizer& another);
+  void ClearUnknown(){m_unknown_refname.clear();}
 };
 
 class CGeneralFeatureVector: public std::vector<CGeneralFeature> {
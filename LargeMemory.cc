@@ -0,0 +1,81 @@
+/**
+ * @file    LargeMemory.cc
+ * @brief   Zero-filled large allocations backed by huge pages when possible
+ */
+
+#include <cstdlib>
+#include <sys/mman.h>
+
+#include "Utility.h"
+#include "LargeMemory.h"
+
+#ifdef BITVECTOR_LIB_BEGIN
+using namespace BitVectorLib;
+#endif
+
+void* CLargeMemory::Allocate(size_t bytes){
+  Release();
+  if(bytes==0) return 0;
+  if(bytes>=HUGE_PAGE_SIZE){
+    size_t rounded=(bytes+HUGE_PAGE_SIZE-1)&~(HUGE_PAGE_SIZE-1);
+#ifdef MAP_HUGETLB
+    void* p=mmap(0,rounded,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB,-1,0);
+    if(p!=MAP_FAILED){
+      m_pointer=p;
+      m_bytes=rounded;
+      m_backing=HUGETLB;
+      return m_pointer;
+    }
+#endif
+    // Map one more huge page and trim both ends so that the range is aligned to huge pages
+    char* q=static_cast<char*>(mmap(0,rounded+HUGE_PAGE_SIZE,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0));
+    if(q!=MAP_FAILED){
+      char* aligned=reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(q)+HUGE_PAGE_SIZE-1)&~static_cast<uintptr_t>(HUGE_PAGE_SIZE-1));
+      if(aligned>q) munmap(q,aligned-q);
+      char* tail=aligned+rounded;
+      char* end=q+rounded+HUGE_PAGE_SIZE;
+      if(end>tail) munmap(tail,end-tail);
+      m_pointer=aligned;
+      m_bytes=rounded;
+      m_backing=MMAP;
+#ifdef MADV_HUGEPAGE
+      if(madvise(aligned,rounded,MADV_HUGEPAGE)==0) m_backing=TRANSPARENT_HUGE_PAGES;
+#endif
+      return m_pointer;
+    }
+  }
+  m_pointer=std::calloc(bytes,1);
+  if(!m_pointer) Quit("Cannot allocate "<<bytes<<" bytes");
+  m_bytes=bytes;
+  m_backing=HEAP;
+  return m_pointer;
+}
+
+void CLargeMemory::Release(){
+  switch(m_backing){
+  case HUGETLB:
+  case TRANSPARENT_HUGE_PAGES:
+  case MMAP:
+    munmap(m_pointer,m_bytes);
+    break;
+  case HEAP:
+    std::free(m_pointer);
+    break;
+  case NONE:
+    break;
+  }
+  m_pointer=0;
+  m_bytes=0;
+  m_backing=NONE;
+}
+
+const char *CLargeMemory::BackingName() const {
+  switch(m_backing){
+  case HUGETLB:                return "hugetlb";
+  case TRANSPARENT_HUGE_PAGES: return "transparent huge pages";
+  case MMAP:                   return "mmap";
+  case HEAP:                   return "heap";
+  case NONE:                   break;
+  }
+  return "none";
+}
@@ -0,0 +1,42 @@
+/**
+ * @file    LargeMemory.h
+ * @brief   Zero-filled large allocations backed by huge pages when possible
+ */
+
+#ifndef _LARGE_MEMORY_H_
+#define _LARGE_MEMORY_H_
+
+#include <stdint.h>
+#include <cstddef>
+
+/**
+ * @brief Memory for large arrays, preferring 2 MB pages
+ *
+ * Allocate() tries, in this order, explicit huge pages (MAP_HUGETLB), an
+ * anonymous mapping aligned to 2 MB with madvise(MADV_HUGEPAGE), a plain
+ * anonymous mapping and finally the heap. Backing() tells which one was
+ * obtained. Allocations smaller than a huge page always come from the heap.
+ * The memory is zero-filled in every case.
+ */
+class CLargeMemory {
+ public:
+  typedef enum {NONE, HUGETLB, TRANSPARENT_HUGE_PAGES, MMAP, HEAP} backing_t;
+  static const size_t HUGE_PAGE_SIZE=2*1024*1024;
+ private:
+  void* m_pointer;
+  size_t m_bytes;
+  backing_t m_backing;
+  CLargeMemory(const CLargeMemory&);
+  CLargeMemory& operator=(const CLargeMemory&);
+ public:
+  CLargeMemory(){m_pointer=0; m_bytes=0; m_backing=NONE;}
+  ~CLargeMemory(){Release();}
+  void* Allocate(size_t bytes);
+  void Release();
+  inline void* Pointer() const {return m_pointer;}
+  inline size_t Bytes() const {return m_bytes;}
+  inline backing_t Backing() const {return m_backing;}
+  const char *BackingName() const;
+};
+
+#endif // _LARGE_MEMORY_H_
@@ -113,6 +113,7 @@ public:
   static const int32_t SECONDARY_ALIGNMENT=0x100;
   static const int32_t DISQUALIFIED=0x200;
   static const int32_t DUPLICATE=0x400;
+  static const int32_t SUPPLEMENTARY_ALIGNMENT=0x800;
 
   inline bool IsMultipleFragments()  const {return Flag() & MULTIPLE_FRAGMENTS;}
   inline bool IsProperlyAligned()    const {return Flag() & PROPERLY_ALIGNED;}
@@ -125,6 +126,7 @@ public:
   inline bool IsSecondaryAlignment() const {return Flag() & SECONDARY_ALIGNMENT;}
   inline bool IsDisqualified()       const {return Flag() & DISQUALIFIED;}
   inline bool IsDuplicate()          const {return Flag() & DUPLICATE;}
+  inline bool IsSupplementaryAlignment() const {return Flag() & SUPPLEMENTARY_ALIGNMENT;}
 
   const char* Option(const std::string& k) const;
 
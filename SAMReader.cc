@@ -2,6 +2,7 @@
 #include <cassert>
 #include <cstdio>
 #include <cstdlib>
+#include <limits>
 
 #include "Option.h"
 #include "Utility.h"
@@ -20,6 +21,15 @@ void CSAMReader::Initialize(){
   m_max_position=0;
   m_min_position=-1;
   m_n_total_bases=0;
+  m_all_chromosomes=false;
+  m_region_begin=0;
+  m_region_end=std::numeric_limits<int64_t>::max();
+  m_libraries.clear();
+  m_library_by_name.clear();
+  m_library_by_read_group.clear();
+  m_last_read_group.erase();
+  m_last_library=NO_LIBRARY;
+  m_estimate_thresholds=false;
 }
 
 CSAMReader::CSAMReader(){
@@ -36,6 +46,11 @@ void CSAMReader::SetUp(int32_t chrNo){
   Initialize();
   m_chr = chrNo;
   m_genome_size = Option().RequireInteger("genome-size");
+  if(chrNo==CChromosomeNormalizer::ALL_CHROMOSOMES){
+    // Chromosomes are started one by one while reading
+    m_all_chromosomes=true;
+    m_chr=0;
+  }
   m_margin_size = Option().RequireInteger("margin-size");
   const char *v = Option().Require("library-threshold");
   if(v && *v){
@@ -43,6 +58,7 @@ void CSAMReader::SetUp(int32_t chrNo){
   }else{
     v = "N/A";
   }
+  m_estimate_thresholds = Option().RequireDouble("insert-quantile")>0;
   if(Option().Find("verbose")){
     std::cerr<<"# chromosome="<<MyChr()<<std::endl;
     std::cerr<<"# genome-size="<<GenomeSize()<<std::endl;
@@ -56,6 +72,91 @@ void CSAMReader::SetUp(int32_t chrNo){
 
 void CSAMReader::TreatHeader(const char *text){}
 
+// Parse "@SQ\tSN:<name>\tLN:<length>"
+bool CSAMReader::ParseReference(const char *text, std::string *name, int64_t *length){
+  name->erase();
+  *length=-1;
+  CTokenizer td(text,"\t");
+  while(td.hasNext()){
+    std::string field = td.NextString();
+    if(field.compare(0,3,"SN:")==0) *name=field.substr(3);
+    if(field.compare(0,3,"LN:")==0) *length=std::atol(field.c_str()+3);
+  }
+  return !name->empty() && *length>0;
+}
+
+// Remember the length of a reference sequence
+void CSAMReader::ReadReferenceLength(const char *text){
+  std::string name;
+  int64_t length;
+  if(ParseReference(text,&name,&length)) m_reference_length[name]=length;
+}
+
+int32_t CSAMReader::AddLibrary(const char *name){
+  std::map<std::string,int32_t>::const_iterator it = m_library_by_name.find(name);
+  if(it!=m_library_by_name.end()) return it->second;
+  library_t lib;
+  lib.Name=name;
+  const char *thr = LibraryThreshold(name);
+  lib.Threshold = thr? thr: "";
+  lib.MinDiscordantLength = thr? static_cast<int32_t>(std::atof(thr)): 0;
+  m_libraries.push_back(lib);
+  return m_library_by_name[name]=m_libraries.size()-1;
+}
+
+// "@RG\tID:<id>\tLB:<library>"
+static void parse_read_group(const char *text, std::string *id, std::string *lb){
+  id->erase();
+  lb->erase();
+  CTokenizer td(text,"\t");
+  while(td.hasNext()){
+    std::string field = td.NextString();
+    if(field.compare(0,3,"ID:")==0) *id=field.substr(3);
+    if(field.compare(0,3,"LB:")==0) *lb=field.substr(3);
+  }
+}
+
+// The threshold is looked up by ID first, and by LB otherwise. A threshold
+// estimated by --insert-quantile is for the LB, if any.
+void CSAMReader::ReadReadGroup(const char *text){
+  std::string id, lb;
+  parse_read_group(text,&id,&lb);
+  if(id.empty()) return;
+  const char *name = id.c_str();
+  if(!LibraryThreshold(name) && !lb.empty() && (LibraryThreshold(lb.c_str()) || m_estimate_thresholds)) name=lb.c_str();
+  m_library_by_read_group[id]=AddLibrary(name);
+}
+
+// An LB tag with a threshold, or one to be estimated, comes first, then the read
+// group. Consecutive reads mostly share their read group, so the last one is remembered.
+int32_t CSAMReader::Library(const CSAMAlignment& aln){
+  const char *lb = aln.Option("LB");
+  if(lb && (LibraryThreshold(lb) || m_estimate_thresholds)) return AddLibrary(lb);
+  const char *rg = aln.Option("RG");
+  if(!rg) return NO_LIBRARY;
+  if(m_last_library!=NO_LIBRARY && m_last_read_group==rg) return m_last_library;
+  std::map<std::string,int32_t>::const_iterator it = m_library_by_read_group.find(rg);
+  // Read groups missing in the header are libraries by themselves
+  int32_t lib = (it!=m_library_by_read_group.end())? it->second: (m_library_by_read_group[rg]=AddLibrary(rg));
+  m_last_read_group=rg;
+  m_last_library=lib;
+  return lib;
+}
+
+// Switch to another chromosome. The array size is the length of the
+// reference in the header if any, or --genome-size otherwise.
+void CSAMReader::StartChromosome(int32_t chr, const char *refname){
+  m_chr=chr;
+  m_genome_size = Option().RequireInteger("genome-size");
+  std::map<std::string,int64_t>::const_iterator it = m_reference_length.find(refname);
+  if(it!=m_reference_length.end()) m_genome_size = it->second+1;
+  m_max_position=0;
+  m_min_position=-1;
+  m_n_total_bases=0;
+  if(Option().Find("verbose")) std::cerr<<"# chromosome="<<m_chr<<" ("<<refname<<"), genome-size="<<m_genome_size<<std::endl;
+  BeginChromosome();
+}
+
 //void CCoverageArray::ReadSAM(const char *sam_file, CChromosomeNormalizer& normalizer){
 void CSAMReader::ReadSAM(const char *sam_file, CChromosomeNormalizer& normalizer){
   CCountLines cl("CCoverageArray::ReadSAM");
@@ -67,6 +168,8 @@ void CSAMReader::ReadSAM(const char *sam_file, CChromosomeNormalizer& normalizer
   //while(fr.GetContentLine("@")){
   while(fr.GetContentLine("")){
     if(fr.CurrentLine()[0]=='@'){
+      if(check_prefix("@SQ\t",fr.CurrentLine())) ReadReferenceLength(fr.CurrentLine());
+      if(check_prefix("@RG\t",fr.CurrentLine())) ReadReadGroup(fr.CurrentLine());
       TreatHeader(fr.CurrentLine());
       continue;
     }
@@ -76,6 +179,11 @@ void CSAMReader::ReadSAM(const char *sam_file, CChromosomeNormalizer& normalizer
     int32_t chr = normalizer.Chr(aln.RName());
     if(chr==0){ std::cerr<<"Warning: Unknown reference name : "<<aln.QName()<<std::endl; continue;}
     if(prev_chr>chr) Quit("SAM alignment are not sorted by chromosome: "<<prev_chr<<">"<<chr);
+    if(m_all_chromosomes && chr!=prev_chr){
+      if(prev_chr) FinishChromosome();
+      StartChromosome(chr,aln.RName());
+      prev_begin=0;
+    }
     prev_chr=chr;
     if(chr<MyChr()) continue;
     if(chr>MyChr()) return;
@@ -89,6 +197,8 @@ void CSAMReader::ReadSAM(const char *sam_file, CChromosomeNormalizer& normalizer
 
     if(prev_begin>aln.Start()) Quit("SAM alignments are not sorted by position: "<<prev_begin<<">"<<aln.Start());
     prev_begin=aln.Start();
+    // Alignments overlapping the region from its left belong to the previous one
+    if(aln.Start()<m_region_begin || aln.Start()>=m_region_end) continue;
     //m_read_positions.AddRead(aln.Start(),aln.End());
 
     if(normalizer.Chr(aln.RName()) != MyChr()) continue;
@@ -104,6 +214,7 @@ void CSAMReader::ReadSAM(const char *sam_file, CChromosomeNormalizer& normalizer
 
     Treat(aln, fr.CurrentLine());
   }
+  if(m_all_chromosomes && prev_chr) FinishChromosome();
   if(n_invalid){
     std::cerr<<"Warning: Number of invalid alignments = "<<n_invalid<<std::endl;
   }
@@ -12,6 +12,8 @@
 
 #include <stdint.h>
 #include <vector>
+#include <map>
+#include <string>
 #include "Utility.h"
 #include "FileReader.h"
 #include "GeneralFeature.h"
@@ -34,12 +36,39 @@ class CSAMReader {
   int64_t m_max_position;
   int64_t m_min_position;
   int64_t m_n_total_bases;
+  bool m_all_chromosomes;
+  int64_t m_region_begin;
+  int64_t m_region_end;
+  std::map<std::string,int64_t> m_reference_length; // LN of @SQ lines
+  void ReadReferenceLength(const char *text);
 
   CKVStore m_library_threshold;
+ public:
+  /// A library as reads refer to it, with its threshold from the -B file if any
+  struct library_t {
+    std::string Name;
+    std::string Threshold;          ///< As written in the file; empty if none
+    int32_t MinDiscordantLength;    ///< Shorter pairs are concordant
+    inline bool HasThreshold() const {return !Threshold.empty();}
+  };
+  static const int32_t NO_LIBRARY=-1;
+ private:
+  std::vector<library_t> m_libraries;
+  std::map<std::string,int32_t> m_library_by_name;
+  std::map<std::string,int32_t> m_library_by_read_group;  // ID of @RG lines and RG tags
+  std::string m_last_read_group;
+  int32_t m_last_library;
+  int32_t AddLibrary(const char *name);
+  void ReadReadGroup(const char *text);
+  bool m_estimate_thresholds;  // With --insert-quantile, libraries without thresholds are named by LB
  protected:
   CSAMReader();
+  virtual ~CSAMReader(){}
   inline bool LibraryAvailable() const {return !m_library_threshold.Empty();}
   inline const char *LibraryThreshold(const char *lib) const {return m_library_threshold.Find(lib);}
+  int32_t Library(const CSAMAlignment& aln);
+  inline const library_t& LibraryAt(int32_t lib) const {return m_libraries[lib];}
+  inline int32_t NLibraries() const {return m_libraries.size();}
   inline void UpdateMaxPosition(int64_t p){if(m_max_position<p) m_max_position=p;}
   inline void UpdateMinPosition(int64_t p){
     if(m_min_position<0 || m_min_position>p){
@@ -55,10 +84,20 @@ class CSAMReader {
   inline void AddTotalBases(int32_t nb){m_n_total_bases+=nb;}
   virtual void Treat(const CSAMAlignment& aln, const char *text)=0;
   virtual void TreatHeader(const char *text);
+  // Called around the alignments of each chromosome when every chromosome is read
+  virtual void BeginChromosome(){}
+  virtual void EndChromosome(){}
+  void StartChromosome(int32_t chr, const char *refname);
+  void FinishChromosome(){EndChromosome();}
+  inline bool AllChromosomes() const {return m_all_chromosomes;}
+  /// Treat only alignments starting in [begin,end); call after SetUp()
+  inline void SetRegion(int64_t begin, int64_t end){m_region_begin=begin; m_region_end=end;}
+  inline int64_t RegionBegin() const {return m_region_begin;}
   void Initialize();
  public:
-  void SetUp(int32_t chrNo);
+  void SetUp(int32_t chrNo); // CChromosomeNormalizer::ALL_CHROMOSOMES to read every chromosome
   void ReadSAM(const char *sam_file, CChromosomeNormalizer& cn);
+  static bool ParseReference(const char *sq_line, std::string *name, int64_t *length);
 };
 
 #endif // _COVERAGE_BASE_H_
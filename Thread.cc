@@ -0,0 +1,62 @@
+/**
+ * @file    Thread.cc
+ * @brief   Minimal wrappers of POSIX threads
+ */
+
+#include <iostream>
+#include <sstream>
+#include <unistd.h>
+
+#include "Option.h"
+#include "Utility.h"
+#include "Thread.h"
+
+#ifdef BITVECTOR_LIB_BEGIN
+using namespace BitVectorLib;
+#endif
+
+void* CThreadGroup::Start(void* p){
+  worker_t* w = static_cast<worker_t*>(p);
+  try{
+    w->Group->m_function(w->Group->m_arg,w->ThreadID);
+  }catch(std::string& err){
+    CLock lock(w->Group->m_mutex);
+    if(w->Group->m_error.empty()) w->Group->m_error=err;
+  }
+  return 0;
+}
+
+void CThreadGroup::Run(int32_t n_threads, function_t function, void* arg){
+  if(n_threads<1) n_threads=1;
+  m_function=function;
+  m_arg=arg;
+  m_error.erase();
+  if(n_threads==1){
+    m_function(m_arg,0);
+    return;
+  }
+  std::vector<worker_t> workers(n_threads);
+  for(int32_t i=0;i<n_threads;++i){
+    workers[i].Group=this;
+    workers[i].ThreadID=i;
+    if(pthread_create(&workers[i].Thread,0,Start,&workers[i])!=0){
+      std::ostringstream oss;
+      oss<<"Error: Cannot create thread "<<i;
+      m_error=oss.str();
+      n_threads=i;
+      break;
+    }
+  }
+  for(int32_t i=0;i<n_threads;++i) pthread_join(workers[i].Thread,0);
+  if(!m_error.empty()) throw m_error;
+}
+
+int32_t CThreadGroup::NThreads(){
+  int32_t n = Option().RequireInteger("threads");
+  if(n<0) Quit("Invalid number of threads: "<<n);
+  if(n==0){
+    long p = sysconf(_SC_NPROCESSORS_ONLN);
+    n = p>0? p: 1;
+  }
+  return n;
+}
@@ -0,0 +1,79 @@
+/**
+ * @file    Thread.h
+ * @brief   Minimal wrappers of POSIX threads
+ */
+
+#ifndef _THREAD_H_
+#define _THREAD_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+class CMutex {
+ private:
+  pthread_mutex_t m_mutex;
+  CMutex(const CMutex&);
+  CMutex& operator=(const CMutex&);
+  friend class CCondition;
+ public:
+  CMutex(){pthread_mutex_init(&m_mutex,0);}
+  ~CMutex(){pthread_mutex_destroy(&m_mutex);}
+  inline void Lock(){pthread_mutex_lock(&m_mutex);}
+  inline void Unlock(){pthread_mutex_unlock(&m_mutex);}
+};
+
+/// Hold a mutex during the lifetime of this object.
+class CLock {
+ private:
+  CMutex& m_mutex;
+  CLock(const CLock&);
+  CLock& operator=(const CLock&);
+ public:
+  explicit CLock(CMutex& m):m_mutex(m){m_mutex.Lock();}
+  ~CLock(){m_mutex.Unlock();}
+};
+
+/// Condition variable used with a locked CMutex.
+class CCondition {
+ private:
+  pthread_cond_t m_cond;
+  CCondition(const CCondition&);
+  CCondition& operator=(const CCondition&);
+ public:
+  CCondition(){pthread_cond_init(&m_cond,0);}
+  ~CCondition(){pthread_cond_destroy(&m_cond);}
+  inline void Wait(CMutex& m){pthread_cond_wait(&m_cond,&m.m_mutex);}
+  inline void Signal(){pthread_cond_signal(&m_cond);}
+  inline void Broadcast(){pthread_cond_broadcast(&m_cond);}
+};
+
+/**
+ * @brief Run the same function on several threads and wait for all of them
+ *
+ * The function receives the argument and the thread id (0..n-1). An error
+ * thrown by Quit() in a worker is caught there and thrown again by Run()
+ * in the calling thread after every worker has finished.
+ */
+class CThreadGroup {
+ public:
+  typedef void (*function_t)(void* arg, int32_t thread_id);
+ private:
+  struct worker_t {
+    CThreadGroup* Group;
+    int32_t ThreadID;
+    pthread_t Thread;
+  };
+  function_t m_function;
+  void* m_arg;
+  std::string m_error;
+  CMutex m_mutex;
+  static void* Start(void* p);
+ public:
+  void Run(int32_t n_threads, function_t function, void* arg);
+  /// Number of threads given by --threads; 0 means all online processors.
+  static int32_t NThreads();
+};
+
+#endif // _THREAD_H_
@@ -2,6 +2,9 @@
 // Various useful classes
 // (C) Yasuda, Tomohiro: The university of Tokyo
 
+#include <cstring>
+#include <cmath>
+#include <limits>
 #include "Tool.h"
 #include "Utility.h"
 
@@ -9,40 +12,66 @@
 // Slot manager
 void CSlotManager::SetUp(int32_t sz){
   if(sz<1) Quit("Invalid size of slots: "<<sz);
-  delete [] m_slots;
-  m_slots=0;
+  m_slots.clear();
+  m_segment_used.clear();
+  m_segment_size=sz;
   m_n_used=0;
-  m_slots = new int32_t[m_n_slots=sz];
-  m_free_top=1;
-  for(int32_t i=0;i<m_n_slots-1;++i) m_slots[i]=i+1;
-  m_slots[m_n_slots-1]=INVALID;
-  m_slots[0]=INVALID;
+  m_free_top=INVALID;
+  Grow();
 }
 
-int32_t CSlotManager::Allocate(){
-  if(m_free_top<=0){
-    Assert(1+m_n_used==m_n_slots);
-    Assert(m_free_top==INVALID);
-    return INVALID;
+void CSlotManager::Grow(){
+  int64_t first=m_slots.size();
+  if(first+m_segment_size>std::numeric_limits<int32_t>::max()) return;
+  m_slots.resize(first+m_segment_size);
+  for(int64_t i=first+m_segment_size-1;i>=first;--i){
+    m_slots[i]=m_free_top;
+    m_free_top=i;
+  }
+  if(first==0){
+    m_free_top=m_slots[0];
+    m_slots[0]=INVALID;
+  }
+  m_segment_used.push_back(0);
+}
+
+void CSlotManager::Shrink(){
+  while(m_segment_used.size()>1 && m_segment_used.back()==0){
+    m_segment_used.pop_back();
+    m_slots.resize(m_slots.size()-m_segment_size);
+  }
+  m_free_top=INVALID;
+  for(int32_t i=m_slots.size()-1;i>0;--i){
+    if(m_slots[i]==USED) continue;
+    m_slots[i]=m_free_top;
+    m_free_top=i;
   }
+}
+
+int32_t CSlotManager::Allocate(){
+  if(m_free_top==INVALID) Grow();
+  if(m_free_top==INVALID) return INVALID;
   int32_t new_one=m_free_top;
   m_free_top = m_slots[m_free_top];
   m_slots[new_one]=USED;
   ++m_n_used;
+  ++m_segment_used[new_one/m_segment_size];
   return new_one;
 }
 
 void CSlotManager::Release(int32_t slot){
-  if(slot<=0 || m_n_slots<=slot) Quit("Invalid slot: "<<slot);
+  if(slot<=0 || Capacity()<=slot) Quit("Invalid slot: "<<slot);
   if(m_slots[slot]!=USED) Quit("Slot "<<slot<<" is already free");
   m_slots[slot]=m_free_top;
   --m_n_used;
   m_free_top=slot;
+  --m_segment_used[slot/m_segment_size];
+  if(m_segment_used.size()>1 && m_segment_used.back()==0 && 2*static_cast<int64_t>(m_n_used)<=Capacity()-m_segment_size) Shrink();
 }
 
 void CSlotManager::Write(std::ostream& stream,int32_t indent) const {
-  stream<<"{\"freetop\":"<<m_free_top<<",\"used\":"<<m_n_used<<",\"slots\":[";
-  for(int32_t i=0;i<m_n_slots;++i){
+  stream<<"{\"freetop\":"<<m_free_top<<",\"used\":"<<m_n_used<<",\"segments\":"<<NSegments()<<",\"slots\":[";
+  for(int32_t i=0;i<Capacity();++i){
     if(i) stream<<',';
     stream<<m_slots[i];
   }
@@ -80,14 +109,129 @@ void CSlotManager::Test(std::ostream& stream){
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// Mon Jan  2 11:30:45 2012
-int64_t interval_distance(int32_t start1, int32_t end1, int32_t start2, int32_t end2){
-  Assert(start1<=end1);
-  Assert(start2<=end2);
-  if(start1<=start2 && start2<end1) return 0; // overlap
-  if(start1<end2    && end2 <=end1) return 0; // overlap
-  if(end1<=start2) return start2-end1;
-  if(end2<=start1) return start1-end2;
-  Quit("Unexpected intervals: ["<<start1<<","<<end1<<") vs. ["<<start2<<","<<end2<<")");
+// Read name table
+void CQNameTable::SetUp(int64_t expected){
+  uint64_t capacity=16;
+  while(capacity<2*static_cast<uint64_t>(expected)) capacity<<=1;
+  std::vector<entry_t> old;
+  old.swap(m_entries);
+  entry_t empty={0,EMPTY};
+  m_entries.assign(capacity,empty);
+  m_mask=capacity-1;
+  m_size=0;
+  for(uint64_t i=0;i<old.size();++i) if(old[i].Slot!=EMPTY) Place(old[i].Hash,old[i].Slot);
+}
+
+void CQNameTable::Place(uint64_t hash, int32_t slot){
+  uint64_t i=hash&m_mask;
+  while(m_entries[i].Slot!=EMPTY) i=(i+1)&m_mask;
+  m_entries[i].Hash=hash;
+  m_entries[i].Slot=slot;
+  ++m_size;
+}
+
+void CQNameTable::Insert(uint64_t hash, int32_t slot){
+  if(slot==EMPTY) Quit("Invalid slot: "<<slot);
+  // At most half full
+  if(2*(m_size+1)>static_cast<int64_t>(m_entries.size())) SetUp(m_size+1);
+  Place(hash,slot);
+}
+
+int32_t CQNameTable::Take(const char* name, uint64_t hash){
+  if(m_entries.empty()) return EMPTY;
+  uint64_t i=hash&m_mask;
+  for(;;i=(i+1)&m_mask){
+    const entry_t& e=m_entries[i];
+    if(e.Slot==EMPTY) return EMPTY;
+    if(e.Hash==hash && (e.Slot==RETIRED || m_same_name(m_owner,e.Slot,name))) break;
+  }
+  int32_t slot=m_entries[i].Slot;
+  // Shift back every following entry that may not stay behind the hole
+  uint64_t hole=i;
+  for(uint64_t j=(i+1)&m_mask;m_entries[j].Slot!=EMPTY;j=(j+1)&m_mask){
+    uint64_t home=m_entries[j].Hash&m_mask;
+    if(((j-home)&m_mask) < ((j-hole)&m_mask)) continue;
+    m_entries[hole]=m_entries[j];
+    hole=j;
+  }
+  m_entries[hole].Slot=EMPTY;
+  --m_size;
+  return slot;
+}
+
+void CQNameTable::Retire(uint64_t hash, int32_t slot){
+  for(uint64_t i=hash&m_mask;!m_entries.empty() && m_entries[i].Slot!=EMPTY;i=(i+1)&m_mask){
+    if(m_entries[i].Hash==hash && m_entries[i].Slot==slot){
+      m_entries[i].Slot=RETIRED;
+      return;
+    }
+  }
+  Quit("Slot "<<slot<<" is not in the table");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Text queue
+int64_t CTextQueue::Push(const char* text){
+  int64_t position=m_base+m_buffer.size();
+  m_buffer.insert(m_buffer.end(),text,text+std::strlen(text)+1);
+  return position;
+}
+
+void CTextQueue::PopUntil(int64_t position){
+  if(position<m_head || m_base+static_cast<int64_t>(m_buffer.size())<position) Quit("Invalid position: "<<position);
+  m_head=position;
+  int64_t dead=m_head-m_base;
+  if(dead*2>static_cast<int64_t>(m_buffer.size())){
+    m_buffer.erase(m_buffer.begin(),m_buffer.begin()+dead);
+    m_base=m_head;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Insert size sketch
+CInsertSizeSketch::CInsertSizeSketch(){
+  m_counts.assign(Bin((static_cast<int64_t>(1)<<MAX_BITS)-1)+1,0);
+  m_n=0;
+}
+
+int32_t CInsertSizeSketch::Bin(int64_t size){
+  if(size<0) size=0;
+  if(size>=(static_cast<int64_t>(1)<<MAX_BITS)) size=(static_cast<int64_t>(1)<<MAX_BITS)-1;
+  if(size<(1<<EXACT_BITS)) return size;
+  int32_t e=EXACT_BITS;
+  while((size>>(e+1))>0) ++e;
+  int32_t sub=(size>>(e-SUB_BITS))-(1<<SUB_BITS);
+  return (1<<EXACT_BITS)+((e-EXACT_BITS)<<SUB_BITS)+sub;
+}
+
+int64_t CInsertSizeSketch::UpperBound(int32_t bin){
+  if(bin<(1<<EXACT_BITS)) return bin;
+  int32_t b=bin-(1<<EXACT_BITS);
+  int32_t e=EXACT_BITS+(b>>SUB_BITS);
+  int64_t sub=b&((1<<SUB_BITS)-1);
+  return (((1<<SUB_BITS)+sub+1)<<(e-SUB_BITS))-1;
+}
+
+void CInsertSizeSketch::Add(int64_t size){
+  ++m_counts[Bin(size)];
+  ++m_n;
+}
+
+void CInsertSizeSketch::Merge(const CInsertSizeSketch& other){
+  for(uint32_t i=0;i<m_counts.size();++i) m_counts[i]+=other.m_counts[i];
+  m_n+=other.m_n;
+}
+
+int64_t CInsertSizeSketch::Quantile(double q) const {
+  if(m_n==0) return -1;
+  int64_t target=static_cast<int64_t>(std::ceil(q*m_n));
+  if(target<1) target=1;
+  if(target>m_n) target=m_n;
+  int64_t sum=0;
+  for(uint32_t i=0;i<m_counts.size();++i){
+    sum+=m_counts[i];
+    if(sum>=target) return UpperBound(i);
+  }
+  return UpperBound(m_counts.size()-1);
 }
 
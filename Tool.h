@@ -8,21 +8,39 @@
 #include <stdint.h>
 #include <iostream>
 #include <string>
+#include <vector>
 
+/**
+ * @brief Free list of slot numbers that grows and shrinks by segments
+ *
+ * Slot 0 is never allocated. When no slot is free, Allocate() appends a
+ * segment of SegmentSize() slots. When the last segment is empty and at most
+ * half of the rest is used, it is dropped, and the free list is rebuilt in
+ * ascending order so that low slots are reused first. Owners keep their data
+ * per segment and follow NSegments().
+ */
 class CSlotManager {
  private:
-  int32_t* m_slots;
+  std::vector<int32_t> m_slots;
+  std::vector<int32_t> m_segment_used;
+  int32_t m_segment_size;
   int32_t m_free_top;
-  int32_t m_n_slots;
   int32_t m_n_used;
-  void Initialize(){m_slots=0; m_free_top=-1; m_n_slots=m_n_used=0;}
+  void Initialize(){m_segment_size=0; m_free_top=-1; m_n_used=0;}
+  void Grow();
+  void Shrink();
  public:
   static const int32_t INVALID=0;
   static const int32_t USED=-2;
   inline CSlotManager(){Initialize();}
   inline CSlotManager(int32_t sz){Initialize(); SetUp(sz);}
   inline int32_t Size() const {return m_n_used;}
+  inline int32_t Capacity() const {return m_slots.size();}
+  inline int32_t SegmentSize() const {return m_segment_size;}
+  inline int32_t NSegments() const {return m_segment_used.size();}
+  /// Start with one segment of sz slots
   void SetUp(int32_t sz);
+  /// INVALID only when slot numbers are exhausted
   int32_t Allocate();
   void Release(int32_t slot);
   void Write(std::ostream &stream, int32_t indent=0) const;
@@ -30,6 +48,98 @@ class CSlotManager {
 };
 inline std::ostream& operator<<(std::ostream& s, const CSlotManager& m){m.Write(s); return s;}
 
-int64_t interval_distance(int32_t start1, int32_t end1, int32_t start2, int32_t end2);
+/**
+ * @brief Open-addressing table from read names to slots
+ *
+ * Entries hold a 64-bit FNV-1a hash of the name and the slot inline; the name
+ * itself is not copied but compared with the one in the slot by a callback of
+ * the owner. Collisions are resolved by linear probing and
+ * Take() closes the gap by shifting the following entries back, so no
+ * tombstones are left behind. A RETIRED entry remembers a name whose slot has
+ * been given back; it is matched by the hash alone.
+ */
+class CQNameTable {
+ public:
+  typedef bool (*same_name_t)(const void* owner, int32_t slot, const char* name);
+  static const int32_t EMPTY=0;
+  static const int32_t RETIRED=-1;
+ private:
+  struct entry_t {
+    uint64_t Hash;
+    int32_t Slot;
+  };
+  std::vector<entry_t> m_entries;
+  uint64_t m_mask;
+  int64_t m_size;
+  same_name_t m_same_name;
+  const void* m_owner;
+  void Place(uint64_t hash, int32_t slot);
+ public:
+  inline CQNameTable(same_name_t same_name, const void* owner){m_mask=0; m_size=0; m_same_name=same_name; m_owner=owner;}
+  /// Room for expected names without growing
+  void SetUp(int64_t expected);
+  /// Hash of the name up to the terminator, which may be a tab of a SAM line
+  static inline uint64_t Hash(const char* name, char terminator='\0'){
+    uint64_t h=14695981039346656037ULL;
+    for(;*name && *name!=terminator;++name) h=(h^static_cast<uint8_t>(*name))*1099511628211ULL;
+    return h;
+  }
+  /// Remove the name and return its slot; EMPTY if absent
+  int32_t Take(const char* name, uint64_t hash);
+  void Insert(uint64_t hash, int32_t slot);
+  /// Keep the name of the slot after the slot is released
+  void Retire(uint64_t hash, int32_t slot);
+  inline int64_t Size() const {return m_size;}
+  inline int64_t Capacity() const {return m_entries.size();}
+};
+
+/**
+ * @brief First-in first-out store of text lines
+ *
+ * Push() appends a NUL-terminated copy and returns its position, which stays
+ * valid until the line is popped. Lines must be popped in the order they were
+ * pushed. The buffer is compacted once more than half of it has been popped,
+ * so its size follows the lines alive rather than all lines ever pushed.
+ */
+class CTextQueue {
+ private:
+  std::vector<char> m_buffer;
+  int64_t m_base;  // position of m_buffer[0]
+  int64_t m_head;  // position of the oldest line alive
+ public:
+  inline CTextQueue(){m_base=m_head=0;}
+  int64_t Push(const char* text);
+  /// The pointer is invalidated by the next Push()
+  inline const char* At(int64_t position) const {return &m_buffer[position-m_base];}
+  /// Pop every line pushed before position
+  void PopUntil(int64_t position);
+  inline int64_t Bytes() const {return m_buffer.size()-(m_head-m_base);}
+};
+
+/**
+ * @brief Histogram of insert sizes in bounded memory
+ *
+ * Sizes below 2^EXACT_BITS have bins of their own. Above that, each power of
+ * two is split into 2^SUB_BITS bins, so a quantile is at most 1/256 larger
+ * than the exact one; sizes of 2^MAX_BITS or more fall in the last bin.
+ */
+class CInsertSizeSketch {
+ private:
+  static const int32_t EXACT_BITS=12;
+  static const int32_t SUB_BITS=8;
+  static const int32_t MAX_BITS=31;
+  std::vector<int64_t> m_counts;
+  int64_t m_n;
+  static int32_t Bin(int64_t size);
+  static int64_t UpperBound(int32_t bin);
+ public:
+  CInsertSizeSketch();
+  void Add(int64_t size);
+  /// Add the sizes of another sketch
+  void Merge(const CInsertSizeSketch& other);
+  inline int64_t Count() const {return m_n;}
+  /// Smallest bin bound at or below which the fraction q of sizes are; -1 if empty
+  int64_t Quantile(double q) const;
+};
 
 #endif // _TOOL_H_
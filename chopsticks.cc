@@ -5,6 +5,9 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #include <iostream>
+#include <sstream>
+#include <fstream>
+#include <unistd.h>
 //#include <map>
 
 #include "Option.h"
@@ -14,6 +17,9 @@
 #include "SequenceSet.h"
 #include "CoverageArray.h"
 #include "EvidenceFinder.h"
+#include "ChromosomeScheduler.h"
+#include "AsyncWriter.h"
+#include "Thread.h"
 #include "Tool.h"
 
 #include <limits>
@@ -34,9 +40,10 @@ using namespace BitVectorLib;
 COption::Option_t g_option_spec[] = {
   //  {"show-bam-line",            "A",0,"Flag to determine whether alignment in BAM file should be shown",0},
  {"margin-parameter",         "a",1,"The parameter for determining threshold based on coverage of margin region","0"},
- {"library-threshold",        "B",1,"File that contain threshold of discordant pairs for each library",""},
+ {"library-threshold",        "B",1,"File that contain threshold of discordant pairs for each library (read group ID or LB of its @RG line)",""},
  {"bin-size",                 "b",1,"Size of bin for statistical test","1"},
  //  {"show-clipping",            "C",0,"Flag to determine whether all cordinates should be shown",0},
+ {"coverage-cache",           "C",1,"Directory of coverage cache files reused by later runs of 'trim'",""},
  {"coverage-upper-bound",     "d",1,"Threshold of coverage shown","500"},
  {"output-format",            "F",1,"Output format",""},
  {"fragment-threshold",       "f",1,"The threshold of joining fragmented edges","0"},
@@ -47,18 +54,70 @@ COption::Option_t g_option_spec[] = {
  {"clipping-length-threshold","l",1,"Threshold of clipping length","10"},
  {"margin-size",              "M",1,"The size of margine region for calculating outside coverage","0"},
  {"show-memory-usage",        "m",0,"Show memory usage",0},
+ {"sample-lanes",             "N",0,"Keep coverage of each <sam file> of 'trim' and report it per sample",0},
  {"output-stderr",            "O",1,"Type of output to stderr (D(angling),V(ariation))","D"},
+ {"parameter-sweep",          "P",1,"Grid of parameters evaluated by 'trim' in one pass (ex. k=2,3:f=0.5,0.8)",""},
  {"progress-interval",        "p",1,"Interval for progress report","0"},
+ {"insert-quantile",          "Q",1,"Quantile of insert sizes taken as the threshold of libraries missing in the -B file (0: none)","0"},
  //{"mininum-quality-symbol",   "q",1,"The symbol representing the minimum quality in SAM format","'!'"},
  {"refinement-threshold",     "R",1,"Highest coverage where refinement will be applied","-1"},
  {"max-read-length",          "r",1,"Maximum length of short reads","256"},
+ {"stream-refinement",        "S",0,"Refine deletion calls while reading alignments, keeping only a window of coverage",0},
  {"cluster-size-threshold",   "s",1,"Threshold of cluster size","2"},
+ {"threads",                  "t",1,"Number of threads (0: all processors)","1"},
  {"verbose",                  "V",0,"Show extra messages",0},
  {"coverage-window",          "W",1,"Size and scale factor of coverage distribution","0:100:100"},
+ {"window-output",            "w",1,"File of coverage distributions given by -W instead of the standard output (binary if it ends with .bin)",""},
  {"max-chop-length",          "x",1,"Maximum allowed trimming length","200"},
  {0,0,0,0}
 };
 
+// Jobs for CChromosomeScheduler. Each owns its reader and results, and
+// refines on a single thread because chromosomes are already in parallel.
+static void trim_chromosome(CChromosomeScheduler::job_t& job){
+  std::ostringstream out, window, log;
+  CCoverageArray ca;
+  ca.SetUp(CChromosomeNormalizer::ALL_CHROMOSOMES);
+  ca.SetSideStreams(*Option().Find("window-output")? window: out, log);
+  ca.SetNThreads(1);
+  ca.RefineAllChromosomes(out,CCoverageArray::REFINE_FRAGMENTED_EDGE,job.Variants,job.Input.c_str(),job.Normalizer);
+  job.Out=out.str();
+  job.Window=window.str();
+  job.Log=log.str();
+}
+
+static void find_evidence(CChromosomeScheduler::job_t& job){
+  std::ostringstream out, log;
+  CEvidenceFinder ef;
+  job.Variants.Sort();
+  ef.SetUp(job.Chr);
+  ef.SetOutput(out,log,job.First);
+  ef.MakeBin(job.Variants);
+  ef.ReadSAM(job.Input.c_str(),job.Normalizer);
+  job.Out=out.str();
+  job.Log=log.str();
+}
+
+// Jobs for CRegionScheduler, which split a chromosome
+struct evidence_regions_t {
+  int32_t Chr;
+  const CGeneralFeatureVector* Variants;
+  std::vector<CEvidenceFinder::region_t> Results;
+};
+
+static void find_evidence_in_region(CRegionScheduler::job_t& job, void* arg){
+  evidence_regions_t* regions = static_cast<evidence_regions_t*>(arg);
+  std::ostringstream out, log;
+  CEvidenceFinder ef;
+  ef.SetUp(regions->Chr);
+  ef.SetOutput(out,log,job.First);
+  ef.MakeBin(*regions->Variants);
+  ef.SetRegion(job.Index,job.Begin,job.End);
+  ef.ReadRegion(job.Input.c_str(),job.Normalizer,&regions->Results[job.Index]);
+  job.Out=out.str();
+  job.Log=log.str();
+}
+
 int true_main(int argc, char *argv[]){
   // Command line arguments
   int skip = Option().SetUp(argc, argv, g_option_spec);
@@ -70,12 +129,16 @@ int true_main(int argc, char *argv[]){
     helpout<<std::endl;
     helpout<<"DESCRIPTIONS\n";
     helpout<<std::endl;
-    helpout<<"   chopsticks trim <chromosome no.> <accession table> <sam file> <gff/bed file>"<<std::endl;
+    helpout<<"   chopsticks trim <chromosome no.> <accession table> <sam file> [<sam file>...] <gff/bed file>"<<std::endl;
     helpout<<std::endl;
     helpout<<"      Improves resolution of deletion calls by trimming ends of deletion calls.\n";
     helpout<<std::endl;
     helpout<<"      <chromosome no.>\n";
     helpout<<"          ChopSticks focuses on the specified chromosome.\n";
+    helpout<<"          With 'all', every chromosome is refined in a single pass over a\n";
+    helpout<<"          <sam file> sorted by coordinate. If the <sam file> is a BAM file with\n";
+    helpout<<"          an index (.bai or .csi), chromosomes are processed in parallel with -t\n";
+    helpout<<"          option, largest first.\n";
     helpout<<"      <accession table>\n";
     helpout<<"          This file should contains in each line a pare of tab-delimited a chromosome\n";
     helpout<<"          numbers and sequence names.\n";
@@ -84,6 +147,8 @@ int true_main(int argc, char *argv[]){
     helpout<<"      <sam file>\n";
     helpout<<"          Results of mapping NGS sequence to the genome sequence,\n";
     helpout<<"          generated by sequence aligners (ex. BWA).\n";
+    helpout<<"          When several files are given (ex. members of a family), they are read\n";
+    helpout<<"          concurrently with -t option and their coverage is summed.\n";
     helpout<<"      <gff/bed file>\n";
     helpout<<"          Deletion calls to be used.\n";
     helpout<<std::endl;
@@ -95,6 +160,8 @@ int true_main(int argc, char *argv[]){
     helpout<<"         (3) Average coverage in the deletion call.\n";
     helpout<<"         (4) [<Starting position of the deletion>,<Ending position of the deletion>)\n";
     helpout<<"         (5) Improved position of the deletion.\n";
+    helpout<<"         (6) With -N option, average coverage in the deletion for each <sam file>,\n";
+    helpout<<"             separated by ','.\n";
     helpout<<std::endl;
     helpout<<"      EXAMPLE:\n";
     helpout<<"         chopstick -Fbed -V -f0.8 -k2 trim 1 acc2chr.txt alignment.bam deletions.bed > improved.bed\n";
@@ -105,6 +172,9 @@ int true_main(int argc, char *argv[]){
     helpout<<std::endl;
     helpout<<"      Find sequences that support deletion calls given in <gff/bed file>.\n";
     helpout<<"      The command-line arguments are the same as 'trim' subcommand above.\n";
+    helpout<<"      'all' chromosomes require a BAM file with an index (.bai or .csi).\n";
+    helpout<<"      With -t option, a single chromosome of a BAM file with an index is split\n";
+    helpout<<"      into regions read in parallel; reads and counts are the same as with one thread.\n";
     helpout<<std::endl;
     helpout<<"      OUTPUT:\n";
     helpout<<"         (1) standard out\n";
@@ -112,13 +182,18 @@ int true_main(int argc, char *argv[]){
     helpout<<"            If -B option is given, threshold on minimum distance for discordant pair,\n";
     helpout<<"            distance between two reads, and whether the read is discordant or not will be\n";
     helpout<<"            output with YT,YL and YD option values.\n";
+    helpout<<"            With -Q option, libraries missing in the -B file are given the quantile\n";
+    helpout<<"            of the insert sizes of all properly paired reads of the chromosome as\n";
+    helpout<<"            their thresholds, in the same pass over the <sam file>. The output of\n";
+    helpout<<"            each chromosome is then kept in memory until its last read is read.\n";
     helpout<<"         (2) standard error: if -OV is given, tab-delimited values of the following.\n";
     helpout<<"           (2-1) The first 6 values in each line of BED files, separated by ','.\n";
     helpout<<"           (2-2) Read-pairs that span the deletion call.\n";
     helpout<<"                 For each read-pair, its name, its library, and whether the read is\n";
     helpout<<"                 discordant('d') or concordant('c') are reported.\n";
     helpout<<"                 Each read of the spanning reads must be within the distance\n";
-    helpout<<"                 given -L option.\n";
+    helpout<<"                 given -L option. A read-pair is reported for every call it\n";
+    helpout<<"                 spans, so nested or overlapping calls share their read-pairs.\n";
     helpout<<std::endl;
     helpout<<"      EXAMPLE:\n";
     helpout<<"         chopstick -OV -V -L10000 -BBDcfg.txt -M20 evidence 1 acc2chr.txt alignment.bam deletions.bed > spanning.sam 2> spanning-reads.txt\n";
@@ -164,34 +239,90 @@ int true_main(int argc, char *argv[]){
   }
   */
   else if(subcommand=="trim"){
-    if(n_args<5) Quit("Usage: "<<argv[0]<<" trim <chromosome no.> <accession table> <sam file> <gff file>");
+    if(n_args<5) Quit("Usage: "<<argv[0]<<" trim <chromosome no.> <accession table> <sam file> [<sam file>...] <gff file>");
     std::string chr_str(argv[skip+1]);
     CCoverageArray ca;
     CGeneralFeatureVector gfv;
     CChromosomeNormalizer cn;
     cn.Read(argv[skip+2]);
-    ca.SetUp( cn.Chr(chr_str.c_str()) );
+    std::ofstream window_file;
+    const char *window_output = Option().Find("window-output");
+    if(*window_output){
+      window_file.open(window_output,std::ios::binary);
+      if(!window_file) Quit("Cannot open "<<window_output);
+      ca.SetSideStreams(window_file,std::cerr);
+    }
+    int32_t chr = chr_str=="all"? CChromosomeNormalizer::ALL_CHROMOSOMES: cn.Chr(chr_str.c_str());
+    ca.SetUp(chr);
     //gfv.ReadGFF(std::atoi(chr_str.c_str()),cn,argv[skip+4]);
-    gfv.ReadGFF( cn.Chr(chr_str.c_str()), cn, argv[skip+4]);
-    ca.ReadSAM(argv[skip+3],cn);
+    std::vector<const char*> sam_files(argv+skip+3,argv+argc-1);
+    gfv.ReadGFF(chr, cn, argv[argc-1]);
+    if(chr==CChromosomeNormalizer::ALL_CHROMOSOMES){
+      if(Option().Find("stream-refinement")) Quit("--stream-refinement cannot be used with 'all' chromosomes");
+      if(sam_files.size()>1) Quit("'all' chromosomes take only one <sam file>");
+      int32_t n_threads = CThreadGroup::NThreads();
+      if(n_threads>1 && CChromosomeScheduler::HasIndex(sam_files.front())){
+        CChromosomeScheduler scheduler;
+        scheduler.SetUp(sam_files.front(),gfv,cn);
+        scheduler.Run(n_threads,trim_chromosome,cn);
+        scheduler.Write(std::cout,std::cerr,*window_output? &window_file: 0);
+      }else{
+        ca.RefineAllChromosomes(std::cout,CCoverageArray::REFINE_FRAGMENTED_EDGE,gfv,sam_files.front(),cn);
+      }
+    }else if(Option().Find("stream-refinement")){
+      if(sam_files.size()>1) Quit("--stream-refinement takes only one <sam file>");
+      ca.RefineWhileReading(std::cout,CCoverageArray::REFINE_FRAGMENTED_EDGE,gfv,sam_files.front(),cn);
+    }else{
+      ca.ReadSAM(sam_files,cn);
+    }
     if(Option().Find("verbose")){
       std::cerr<<"# Unknown references: ";
       cn.ShowUnknown(std::cerr);
     }
-    ca.RefineRegion(std::cout,CCoverageArray::REFINE_FRAGMENTED_EDGE,gfv);
+    if(chr!=CChromosomeNormalizer::ALL_CHROMOSOMES && ! Option().Find("stream-refinement")) ca.RefineRegion(std::cout,CCoverageArray::REFINE_FRAGMENTED_EDGE,gfv);
   }
   else if(subcommand=="evidence"){
     if(n_args<5) Quit("Usage: "<<argv[0]<<" evidence <chromosome no.> <accession table> <sam file> <gff file>");
     std::string chr_str(argv[skip+1]);
-    CEvidenceFinder ef;
     CGeneralFeatureVector gfv;
     CChromosomeNormalizer cn;
     cn.Read(argv[skip+2]);
-    gfv.ReadGFF( cn.Chr(chr_str.c_str()), cn, argv[skip+4]);
-    gfv.Sort();
-    ef.SetUp( cn.Chr(chr_str.c_str()) );
-    ef.MakeBin( gfv );
-    ef.ReadSAM(argv[skip+3],cn);
+    // Reads and reports are written by background threads without flushing every line
+    CAsyncWriter out_buffer(STDOUT_FILENO), log_buffer(STDERR_FILENO);
+    std::ostream out(&out_buffer), log(&log_buffer);
+    if(chr_str=="all"){
+      if(!CChromosomeScheduler::HasIndex(argv[skip+3])) Quit("'all' chromosomes require an index (.bai or .csi) of the BAM file: "<<argv[skip+3]);
+      gfv.ReadGFF(CChromosomeNormalizer::ALL_CHROMOSOMES, cn, argv[skip+4]);
+      CChromosomeScheduler scheduler;
+      scheduler.SetUp(argv[skip+3],gfv,cn);
+      scheduler.Run(CThreadGroup::NThreads(),find_evidence,cn);
+      scheduler.Write(out,log);
+    }else{
+      CEvidenceFinder ef;
+      int32_t chr = cn.Chr(chr_str.c_str());
+      gfv.ReadGFF( chr, cn, argv[skip+4]);
+      gfv.Sort();
+      ef.SetUp( chr );
+      ef.MakeBin( gfv );
+      int32_t n_threads = CThreadGroup::NThreads();
+      CRegionScheduler scheduler;
+      if(n_threads>1 && CChromosomeScheduler::HasIndex(argv[skip+3]) && scheduler.SetUp(argv[skip+3],chr,n_threads,cn)){
+        evidence_regions_t regions;
+        regions.Chr=chr;
+        regions.Variants=&gfv;
+        regions.Results.resize(scheduler.NJobs());
+        scheduler.Run(n_threads,find_evidence_in_region,&regions,cn);
+        // The header comes with the first region
+        ef.SetOutput(out,log,false);
+        for(uint32_t i=0;i<scheduler.NJobs();++i) ef.MergeRegion(regions.Results[i],scheduler.Job(i).Out,scheduler.Job(i).Log);
+        ef.FinishMerge();
+      }else{
+        ef.SetOutput(out,log,true);
+        ef.ReadSAM(argv[skip+3],cn);
+      }
+    }
+    out_buffer.Close();
+    log_buffer.Close();
     if(Option().Find("verbose")){
       std::cerr<<"Unknown references: ";
       cn.ShowUnknown(std::cerr);